@@ -0,0 +1,216 @@
+//============================================================================
+// Name        : BatchPool.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef BATCHPOOL_H
+#define BATCHPOOL_H
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include "EquationPipeline.h" // BoundedQueue
+
+#ifndef BATCH_SYSTEMS_PER_THREAD
+#define BATCH_SYSTEMS_PER_THREAD 16 // Systems per thread that may be read ahead of the output
+#endif
+
+/* Batch mode, for solving many small equation systems in one process. The systems are read from one file (or
+ * stdin), separated by empty lines, and solved concurrently on a work stealing pool. A reader thread hands every
+ * system to the pool through a bounded queue as soon as its empty line is read, so solving starts while the input is
+ * still being read, and at most BATCH_SYSTEMS_PER_THREAD systems per thread are held between reading and printing.
+ * Every thread has a queue of systems and takes the oldest one from it, and when it is empty, it steals the newest
+ * system from another thread's queue. The results are printed in input order, each followed by an empty line, as
+ * soon as all the systems before them are done. The systems are numbered from 0 in error messages and the
+ * throughput is reported on stderr
+ */
+
+struct BatchResult {
+	std::string out,err; // What the solver would have printed to stdout and stderr for the system
+};
+
+static void readSystems(std::istream& in, const std::function<void(std::string&)>& add) {
+	// Calls add for every system as soon as it ends. Every empty line ends a system, so two empty lines in a row make
+	// an empty system
+	std::string line,system;
+	bool inSystem=false;
+	while (getline(in,line)) {
+		if (line.empty()) {
+			add(system);
+			system.clear();
+			inSystem=false;
+			continue;
+		}
+		system += line + '\n';
+		inSystem=true;
+	}
+	if (inSystem) {add(system);}
+}
+
+class WorkStealingPool {
+public:
+	/* Runs solve(system,thread,result) for every system read from in, on nrThreads threads, and calls
+	 * emit(task,result) in the calling thread, in input order, once a system and all systems before it are done. The
+	 * tasks are the systems' sequence numbers, from 0. thread can be used to index buffers that every thread reuses
+	 * between systems. Returns the number of systems
+	 */
+	static int run(std::istream& in, int nrThreads, const std::function<void(const std::string&,int,BatchResult&)>& solve,
+			const std::function<void(int,BatchResult&)>& emit) {
+		int window = nrThreads*BATCH_SYSTEMS_PER_THREAD;
+		WorkStealingPool pool(nrThreads,window);
+		BoundedQueue<std::string> systemQueue(window);
+		std::thread reader([&]() {
+			readSystems(in,[&](std::string& system) {systemQueue.push(std::move(system));});
+			systemQueue.close();
+		});
+		std::vector<std::thread> threads;
+		for (int t=0;t<nrThreads;t++) {threads.push_back(std::thread(&WorkStealingPool::workerLoop,&pool,t,std::cref(solve)));}
+
+		int nrTasks=0,nrEmitted=0;
+		std::string system;
+		while (systemQueue.pop(system)) {
+			// The slot of the new task is free once the task window before it is printed
+			if (nrTasks-nrEmitted==window) {pool.emitTask(nrEmitted++,emit);}
+			while (nrEmitted<nrTasks && pool.isDone(nrEmitted)) {pool.emitTask(nrEmitted++,emit);}
+			pool.addTask(nrTasks++,system);
+		}
+		pool.finish();
+		while (nrEmitted<nrTasks) {pool.emitTask(nrEmitted++,emit);}
+		for (int t=0;t<nrThreads;t++) {threads[t].join();}
+		reader.join();
+		return nrTasks;
+	}
+
+private:
+	struct TaskQueue {
+		std::mutex mutex;
+		std::deque<int> tasks;
+	};
+
+	struct TaskSlot {
+		std::string system;
+		BatchResult result;
+		char done;
+	};
+
+	WorkStealingPool(int nrThreads, int window) : queues(nrThreads), slots(window), nrQueued(0), finished(false) {}
+
+	void addTask(int task, std::string& system) {
+		// Deals the tasks out round robin, so that every thread gets the earliest ones
+		TaskSlot& slot = slots[task%slots.size()];
+		slot.system.swap(system);
+		{
+			std::lock_guard<std::mutex> lock(doneMutex);
+			slot.done=0;
+		}
+		{
+			std::lock_guard<std::mutex> lock(queues[task%queues.size()].mutex);
+			queues[task%queues.size()].tasks.push_back(task);
+		}
+		{
+			std::lock_guard<std::mutex> lock(workMutex);
+			nrQueued++;
+		}
+		workCondition.notify_one();
+	}
+
+	void finish() {
+		{
+			std::lock_guard<std::mutex> lock(workMutex);
+			finished=true;
+		}
+		workCondition.notify_all();
+	}
+
+	bool isDone(int task) {
+		std::lock_guard<std::mutex> lock(doneMutex);
+		return slots[task%slots.size()].done!=0;
+	}
+
+	void emitTask(int task, const std::function<void(int,BatchResult&)>& emit) {
+		TaskSlot& slot = slots[task%slots.size()];
+		{
+			std::unique_lock<std::mutex> lock(doneMutex);
+			doneCondition.wait(lock,[&]{return slot.done!=0;});
+		}
+		emit(task,slot.result);
+		std::string().swap(slot.system);
+	}
+
+	bool tryTakeTask(int thread, int& task) {
+		{
+			std::lock_guard<std::mutex> lock(queues[thread].mutex);
+			if (!queues[thread].tasks.empty()) {
+				task = queues[thread].tasks.front();
+				queues[thread].tasks.pop_front();
+				return true;
+			}
+		}
+		for (size_t i=1;i<queues.size();i++) {
+			TaskQueue& victim = queues[(thread+i)%queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				task = victim.tasks.back();
+				victim.tasks.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool takeTask(int thread, int& task) {
+		// Waits for the reader while all queues are empty. Returns false once the input is read and all tasks are taken
+		while (true) {
+			if (tryTakeTask(thread,task)) {
+				std::lock_guard<std::mutex> lock(workMutex);
+				nrQueued--;
+				return true;
+			}
+			std::unique_lock<std::mutex> lock(workMutex);
+			workCondition.wait(lock,[this]{return nrQueued>0 || finished;});
+			if (nrQueued==0) {return false;}
+		}
+	}
+
+	void workerLoop(int thread, const std::function<void(const std::string&,int,BatchResult&)>& solve) {
+		int task;
+		while (takeTask(thread,task)) {
+			TaskSlot& slot = slots[task%slots.size()];
+			solve(slot.system,thread,slot.result);
+			{
+				std::lock_guard<std::mutex> lock(doneMutex);
+				slot.done=1;
+			}
+			doneCondition.notify_one();
+		}
+	}
+
+	std::vector<TaskQueue> queues;
+	std::vector<TaskSlot> slots; // The tasks in the window, at task modulo the window size
+	int nrQueued; // Tasks in the queues that are not taken yet
+	bool finished; // Whether the reader is done, so that no more tasks are added
+	std::mutex workMutex,doneMutex;
+	std::condition_variable workCondition,doneCondition;
+};
+
+static void printBatchResult(int system, BatchResult& result) {
+	// The output of every system is followed by an empty line. Error messages go to stderr, with the system number
+	std::cout << result.out << '\n';
+	if (!result.err.empty()) {std::cerr << "System " << system << ": " << result.err;}
+	std::string().swap(result.out);
+	std::string().swap(result.err);
+}
+
+static void reportThroughput(int nrSystems, std::chrono::steady_clock::time_point start) {
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	std::cerr << nrSystems << " systems in " << seconds << " s, " << (seconds>0 ? nrSystems/seconds : 0) << " systems per second" << std::endl;
+}
+
+#endif
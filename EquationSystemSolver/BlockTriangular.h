@@ -0,0 +1,110 @@
+//============================================================================
+// Name        : BlockTriangular.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef BLOCKTRIANGULAR_H
+#define BLOCKTRIANGULAR_H
+
+#include <vector>
+#include <algorithm>
+
+/* Block triangular form of an equation system. Row i defines variable i, and depends on the variables j that appear
+ * on its right hand side. The strongly connected components of this dependency graph (found with Tarjan's
+ * algorithm) are the diagonal blocks: ordering the rows block by block, with the blocks a block depends on first,
+ * makes the matrix block lower triangular. The system can then be solved one block at a time, with the variables of
+ * the earlier blocks already known. Since every equation defines its own variable, the matching step of the
+ * Dulmage-Mendelsohn decomposition isn't needed, the diagonal is used as the matching.
+ *
+ * The blocks are also sorted in levels. A block only depends on blocks in lower levels, so all blocks in a level can
+ * be solved at the same time. Blocks of one row that don't depend on themselves are solved by substitution
+ */
+
+struct BlockDecomposition {
+	std::vector<int> rows; // The rows, block after block
+	std::vector<int> blockStart; // Block k is rows[blockStart[k]] to rows[blockStart[k+1]-1]
+	std::vector<int> levelStart; // The blocks of level l are levelStart[l] to levelStart[l+1]-1
+
+	int nrBlocks() const {return blockStart.size()-1;}
+	int nrLevels() const {return levelStart.size()-1;}
+	int blockSize(int k) const {return blockStart[k+1]-blockStart[k];}
+};
+
+static void findBlocks(int nrRows, const std::vector<int>& rowStart, const std::vector<int>& cols, BlockDecomposition& blocks) {
+	/* The dependencies of row i are cols[rowStart[i]] to cols[rowStart[i+1]-1]. Tarjan's algorithm without recursion,
+	 * since a chain of dependencies can be as long as the system. It finds the components with their dependencies
+	 * first
+	 */
+	std::vector<int> index(nrRows,-1),lowLink(nrRows),component(nrRows,-1),stack,callStack,nextEdge(nrRows);
+	int nextIndex=0,nrComponents=0;
+
+	for (int root=0;root<nrRows;root++) {
+		if (index[root]!=-1) {continue;}
+		callStack.push_back(root);
+		index[root]=lowLink[root]=nextIndex++;
+		nextEdge[root]=rowStart[root];
+		stack.push_back(root);
+
+		while (!callStack.empty()) {
+			int row = callStack.back();
+			if (nextEdge[row]<rowStart[row+1]) {
+				int dependency = cols[nextEdge[row]++];
+				if (index[dependency]==-1) {
+					// Descend
+					index[dependency]=lowLink[dependency]=nextIndex++;
+					nextEdge[dependency]=rowStart[dependency];
+					stack.push_back(dependency);
+					callStack.push_back(dependency);
+				}
+				else if (component[dependency]==-1) {lowLink[row] = std::min(lowLink[row],index[dependency]);} // On the stack
+				continue;
+			}
+
+			// All dependencies visited
+			callStack.pop_back();
+			if (!callStack.empty()) {lowLink[callStack.back()] = std::min(lowLink[callStack.back()],lowLink[row]);}
+			if (lowLink[row]==index[row]) {
+				int member;
+				do {
+					member = stack.back();
+					stack.pop_back();
+					component[member]=nrComponents;
+				} while (member!=row);
+				nrComponents++;
+			}
+		}
+	}
+
+	// The level of a component is one more than the highest level it depends on
+	std::vector<std::vector<int>> members(nrComponents);
+	for (int row=0;row<nrRows;row++) {members[component[row]].push_back(row);}
+	std::vector<int> level(nrComponents,0);
+	int nrLevels = (nrRows>0) ? 1 : 0;
+	for (int c=0;c<nrComponents;c++) {
+		for (int row : members[c]) {
+			for (int k=rowStart[row];k<rowStart[row+1];k++) {
+				if (component[cols[k]]!=c) {level[c] = std::max(level[c],level[component[cols[k]]]+1);}
+			}
+		}
+		nrLevels = std::max(nrLevels,level[c]+1);
+	}
+
+	// Number the blocks level by level
+	blocks.levelStart.assign(nrLevels+1,0);
+	for (int c=0;c<nrComponents;c++) {blocks.levelStart[level[c]+1]++;}
+	for (int l=0;l<nrLevels;l++) {blocks.levelStart[l+1]+=blocks.levelStart[l];}
+	std::vector<int> blockOfComponent(nrComponents),nextInLevel(blocks.levelStart.begin(),blocks.levelStart.end()-1);
+	for (int c=0;c<nrComponents;c++) {blockOfComponent[c] = nextInLevel[level[c]]++;}
+
+	std::vector<int> componentOfBlock(nrComponents);
+	for (int c=0;c<nrComponents;c++) {componentOfBlock[blockOfComponent[c]]=c;}
+	blocks.rows.clear();
+	blocks.blockStart.assign(1,0);
+	for (int k=0;k<nrComponents;k++) {
+		const std::vector<int>& blockRows = members[componentOfBlock[k]];
+		blocks.rows.insert(blocks.rows.end(),blockRows.begin(),blockRows.end());
+		blocks.blockStart.push_back(blocks.rows.size());
+	}
+}
+
+#endif
@@ -0,0 +1,191 @@
+//============================================================================
+// Name        : CompressedRows.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef COMPRESSEDROWS_H
+#define COMPRESSEDROWS_H
+
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <stdint.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Compressed sparse rows for the iterative solvers, which are bound by how many bytes a sweep reads. The coefficients
+ * are repeat counts, so they are almost always 1, and are stored with as few bits as the largest one needs: none at
+ * all if they are all 1 (only the pattern is stored), or 8, 16 or 32 bits. The columns of a row are sorted and stored
+ * as the first column of the row and the differences to the column before, in 8, 16 or 32 bits depending on the
+ * largest difference. Compared to 32 bit columns and coefficients that is 2 instead of 8 bytes per nonzero for a
+ * pattern with 16 bit differences.
+ *
+ * The kernels decode the columns while they use them. Compiled with AVX2 (-mavx2 or -march=native), rows with at
+ * least 8 nonzeros are done 8 at a time: the differences are widened and prefix summed in the vector registers, and x
+ * is gathered with them. Shorter rows, and the end of the longer ones, are done one nonzero at a time. The sweep also
+ * runs on double vectors, for the multigrid solver (Multigrid.h), but then always one nonzero at a time
+ */
+
+struct UnitCoefficient {}; // The value type of a pattern, every coefficient is 1
+
+template <typename Value> static inline int coefficientAt(const Value* values, int k) {return values[k];}
+template <> inline int coefficientAt<UnitCoefficient>(const UnitCoefficient*, int) {return 1;}
+
+#ifdef __AVX2__
+template <typename T> static inline __m256i loadWidened(const T* p);
+template <> inline __m256i loadWidened<uint8_t>(const uint8_t* p) {return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p));}
+template <> inline __m256i loadWidened<uint16_t>(const uint16_t* p) {return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));}
+template <> inline __m256i loadWidened<uint32_t>(const uint32_t* p) {return _mm256_loadu_si256((const __m256i*)p);}
+template <> inline __m256i loadWidened<int>(const int* p) {return _mm256_loadu_si256((const __m256i*)p);}
+
+template <typename Value> static inline __m256i multiplyCoefficients(const Value* values, int k, __m256i xs) {return _mm256_mullo_epi32(loadWidened(values+k),xs);}
+template <> inline __m256i multiplyCoefficients<UnitCoefficient>(const UnitCoefficient*, int, __m256i xs) {return xs;}
+#endif
+
+class CompressedRows {
+public:
+	CompressedRows() : valueBits(0), deltaBits(32), nrNonZeros(0) {}
+
+	void encode(const std::vector<int>& rowStart, const std::vector<int>& cols, const std::vector<int>& coefs, int firstRow, int endRow) {
+		// Encodes rows firstRow to endRow-1 of the compressed rows rowStart, cols and coefs, which may be in any order
+		int maxCoef=1;
+		unsigned maxDelta=0;
+		std::vector<std::pair<int,int>> row;
+		std::vector<int> sortedCols,sortedCoefs;
+		starts.assign(1,0);
+		firstCols.clear();
+		for (int i=firstRow;i<endRow;i++) {
+			row.clear();
+			for (int k=rowStart[i];k<rowStart[i+1];k++) {row.push_back(std::make_pair(cols[k],coefs[k]));}
+			sort(row.begin(),row.end());
+			firstCols.push_back(row.empty() ? 0 : row[0].first);
+			for (size_t k=0;k<row.size();k++) {
+				if (k>0) {maxDelta = std::max(maxDelta,(unsigned)(row[k].first-row[k-1].first));}
+				maxCoef = std::max(maxCoef,row[k].second);
+				sortedCols.push_back(row[k].first);
+				sortedCoefs.push_back(row[k].second);
+			}
+			starts.push_back(sortedCols.size());
+		}
+		nrNonZeros=sortedCols.size();
+
+		valueBits = (maxCoef==1) ? 0 : (maxCoef<=UINT8_MAX) ? 8 : (maxCoef<=UINT16_MAX) ? 16 : 32;
+		deltaBits = (maxDelta<=UINT8_MAX) ? 8 : (maxDelta<=UINT16_MAX) ? 16 : 32;
+		switch (valueBits) {
+			case 0: values.clear(); break;
+			case 8: store<uint8_t>(sortedCoefs,values); break;
+			case 16: store<uint16_t>(sortedCoefs,values); break;
+			default: store<int>(sortedCoefs,values); break;
+		}
+
+		// The first nonzero of every row gets the difference 0, to its first column
+		for (int r=0;r<nrRows();r++) {
+			for (int k=starts[r+1]-1;k>starts[r];k--) {sortedCols[k]-=sortedCols[k-1];}
+			if (starts[r]<starts[r+1]) {sortedCols[starts[r]]=0;}
+		}
+		switch (deltaBits) {
+			case 8: store<uint8_t>(sortedCols,deltas); break;
+			case 16: store<uint16_t>(sortedCols,deltas); break;
+			default: store<uint32_t>(sortedCols,deltas); break;
+		}
+	}
+
+	int nrRows() const {return starts.size()-1;}
+
+	long long bytes() const {
+		// What a sweep reads of the matrix
+		return (long long)nrNonZeros*(valueBits+deltaBits)/8 + (long long)nrRows()*2*sizeof(int);
+	}
+
+	std::string description() const {
+		std::ostringstream ss;
+		if (valueBits==0) {ss << "pattern only";}
+		else {ss << valueBits << " bit coefficients";}
+		ss << ", " << deltaBits << " bit column differences, " << (nrNonZeros ? (double)bytes()/nrNonZeros : 0) << " bytes per nonzero";
+		return ss.str();
+	}
+
+	template <typename Number> Number sweep(const Number* b, const Number* x, Number* xNew, int firstRow) const {
+		/* xNew[i] = b[i] + the coefficients of row i times x, for the rows i from firstRow on. Returns the sum of
+		 * |x[i]-xNew[i]|. x and xNew may be the same array, then the rows see the new values of the rows before them
+		 * (Gauss-Seidel)
+		 */
+		switch (valueBits) {
+			case 0: return sweepDeltas<UnitCoefficient>(b,x,xNew,firstRow);
+			case 8: return sweepDeltas<uint8_t>(b,x,xNew,firstRow);
+			case 16: return sweepDeltas<uint16_t>(b,x,xNew,firstRow);
+			default: return sweepDeltas<int>(b,x,xNew,firstRow);
+		}
+	}
+
+private:
+	template <typename T> static void store(const std::vector<int>& from, std::vector<unsigned char>& to) {
+		to.resize(from.size()*sizeof(T));
+		T* typed = (T*)to.data();
+		for (size_t k=0;k<from.size();k++) {typed[k]=(T)from[k];}
+	}
+
+	template <typename Value, typename Number> Number sweepDeltas(const Number* b, const Number* x, Number* xNew, int firstRow) const {
+		switch (deltaBits) {
+			case 8: return sweepRows<Value,uint8_t,Number>(b,x,xNew,firstRow);
+			case 16: return sweepRows<Value,uint16_t,Number>(b,x,xNew,firstRow);
+			default: return sweepRows<Value,uint32_t,Number>(b,x,xNew,firstRow);
+		}
+	}
+
+#ifdef __AVX2__
+	template <typename Value, typename Delta> static int sumVectorized(const Value* coefs, const Delta* colDeltas, int& k, int end, int& col, const int* x) {
+		// The nonzeros of a row 8 at a time, as long as there are 8 left. Moves k and col past them
+		__m256i sums=_mm256_setzero_si256(), base=_mm256_set1_epi32(col), zero=_mm256_setzero_si256();
+		const __m256i lowTotal=_mm256_setr_epi32(0,0,0,0,3,3,3,3), last=_mm256_set1_epi32(7);
+		for (;k+8<=end;k+=8) {
+			// Prefix sum of the 8 differences, first within the 128 bit halves, then the low half onto the high
+			__m256i colVector = loadWidened(colDeltas+k);
+			colVector = _mm256_add_epi32(colVector,_mm256_slli_si256(colVector,4));
+			colVector = _mm256_add_epi32(colVector,_mm256_slli_si256(colVector,8));
+			colVector = _mm256_add_epi32(colVector,_mm256_blend_epi32(zero,_mm256_permutevar8x32_epi32(colVector,lowTotal),0xF0));
+			colVector = _mm256_add_epi32(colVector,base);
+			base = _mm256_permutevar8x32_epi32(colVector,last);
+			sums = _mm256_add_epi32(sums,multiplyCoefficients(coefs,k,_mm256_i32gather_epi32(x,colVector,4)));
+		}
+		__m128i half = _mm_add_epi32(_mm256_castsi256_si128(sums),_mm256_extracti128_si256(sums,1));
+		half = _mm_add_epi32(half,_mm_shuffle_epi32(half,0x4E));
+		half = _mm_add_epi32(half,_mm_shuffle_epi32(half,0xB1));
+		col = _mm_cvtsi128_si32(_mm256_castsi256_si128(base));
+		return _mm_cvtsi128_si32(half);
+	}
+
+	template <typename Value, typename Delta> static double sumVectorized(const Value*, const Delta*, int&, int, int&, const double*) {return 0;} // Not vectorized
+#endif
+
+	template <typename Value, typename Delta, typename Number> Number sweepRows(const Number* b, const Number* x, Number* xNew, int firstRow) const {
+		const Value* coefs = (const Value*)values.data();
+		const Delta* colDeltas = (const Delta*)deltas.data();
+		Number error=0;
+		for (int r=0;r<nrRows();r++) {
+			int i=firstRow+r, col=firstCols[r], k=starts[r], end=starts[r+1];
+			Number sum=b[i];
+#ifdef __AVX2__
+			if (end-k>=8) {sum += sumVectorized(coefs,colDeltas,k,end,col,x);}
+#endif
+			for (;k<end;k++) {
+				col+=colDeltas[k];
+				sum+=coefficientAt(coefs,k)*x[col];
+			}
+			error+=std::abs(x[i]-sum);
+			xNew[i]=sum;
+		}
+		return error;
+	}
+
+	int valueBits,deltaBits;
+	long long nrNonZeros;
+	std::vector<int> starts,firstCols; // Per row
+	std::vector<unsigned char> values,deltas; // Per nonzero, of the types given by valueBits and deltaBits
+};
+
+#endif
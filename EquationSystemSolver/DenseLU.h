@@ -0,0 +1,128 @@
+//============================================================================
+// Name        : DenseLU.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef DENSELU_H
+#define DENSELU_H
+
+#include <math.h>
+#include "NumaPlacement.h"
+
+#ifndef PARALLEL_MIN_ROWS
+#define PARALLEL_MIN_ROWS 256 // Below this many rows left to update, LU factorization continues on one thread
+#endif
+
+/* LU factorization of a dense matrix, stored as an array of row pointers, with a row swap wherever a pivot is zero.
+ * Used by TCcalc, and by the multigrid solver of TCcalcJacobi for its coarsest level (Multigrid.h)
+ */
+
+static inline bool isZero(double val) {
+	/* In large equation systems rounding errors becomes a factor. When doing LU factorization, it is possible to encounter
+	 * diagonal value that should be zero, but is instead very close to zero, due to rounding errors in the calculations.
+	 * Example: 1 - 1/3 * 3 is zero in math world, but 0.0000000...1 in computer world, since 1/3 is represented as
+	 * 0.333333333... Therefore this function decides whether a value is zero or not
+	 */
+
+	if (fabs(val)<0.000001) {return true;}
+	return false;
+}
+
+static void updateRows(double** A, int col, int firstRow, int rowStep, int matSize) {
+	for (int row=firstRow;row<matSize;row+=rowStep) {
+		/* This is the standard LU factorization algorithm, described here:
+		 * https://equilibriumofnothing.files.wordpress.com/2013/10/matrix_factorlup.png or here:
+		 * http://cseweb.ucsd.edu/~baden/classes/Exemplars/260_fa06/Ricketts_SR.pdf
+		 */
+		A[row][col] /= A[col][col];
+		for (int col2=col+1;col2<matSize;col2++) {
+			A[row][col2] = A[row][col2] - A[col][col2] * A[row][col];
+		}
+	}
+}
+
+static bool LUPfactorize(double** A, int* P, int matSize, WorkerPool* pool = NULL) {
+	/* Factorizes the matrix A into a lower and upper triangular matrix and stores it in A. When
+	 * the algorithm is complete. A will constitute of an upper and lower triangular matrix A = L+U
+	 * The diagonal of A belongs to the upper matrix. The diagonal of the lower matrix consists of ones
+	 */
+
+	int swapRoxIndex,tempPval;
+	double* tempRowPointer,maxValInCol;
+
+	for (int i = 0; i < matSize; i++) {P[i] = i;} // Set the permutation matrix to identity
+
+	for (int col=0; col<matSize-1; col++) {
+		if (isZero(A[col][col])) {
+			/* If the diagonal of A is zero, then we need to permutate the matrix to avoid dividing by zero. If all the entries in
+			 * A[-][col] are zero then the matrix A is singular, and the equation system has no (or an infinite
+			 * number of) solutions
+			 */
+			maxValInCol=0;
+			swapRoxIndex = col;
+			for (int row=col+1;row<matSize;row++) {
+//				if (!isZero(A[row][col])) {
+//					/* Normally you want to find the _largest_ absolute value in A[row=col+1 to row = matSize-1][col] here, which gives
+//					 * higher precision in the answer; however i choose the first non-zero value, which takes less time, without sacrificing
+//					 * much accuracy
+//					 */
+//					swapRoxIndex = row;
+//					break;
+//				}
+				// Get the largest value in the column
+				if (fabs(A[row][col])>fabs(maxValInCol)) {
+					maxValInCol = A[row][col];
+					swapRoxIndex = row;
+				}
+			}
+			if (isZero(maxValInCol)) {return false;} // Singular
+			// Pointer swap the rows in A
+			tempRowPointer = A[col];
+			A[col] = A[swapRoxIndex];
+			A[swapRoxIndex] = tempRowPointer;
+
+			tempPval = P[col];
+			P[col]= P[swapRoxIndex];
+			P[swapRoxIndex] = tempPval;
+		}
+
+		if (pool && matSize-col > PARALLEL_MIN_ROWS) {
+			// Rows are owned round robin (row % workers), each worker updates the rows it allocated
+			int nrWorkers = pool->size();
+			pool->run([&](int w) {
+				int firstRow = col+1 + ((w - (col+1)%nrWorkers) + nrWorkers) % nrWorkers;
+				updateRows(A,col,firstRow,nrWorkers,matSize);
+				pool->addBytesTouched(w,(long long)((matSize-firstRow+nrWorkers-1)/nrWorkers)*(matSize-col)*sizeof(double));
+			});
+		}
+		else {updateRows(A,col,col+1,1,matSize);}
+	}
+
+	/* At this stage, A[matSize-1][matSize-1] may be zero, since the outermost col-iterating loop doesnt
+	 * go through the last column (by design). Therefore, it doesn't check if A[matSize-1][matSize-1] or try to permutate it.
+	 * The check is instead done here. If this check is passed, all diagonal values in A (which is the same as the diagonal
+	 * in the upper triangular matrix) are guaranteed to be non-zero
+	 */
+	if (isZero(A[matSize-1][matSize-1])) {return false;}
+	return true;
+}
+
+static void LUPsolve(double** A, const int* P, const double* b, double* x, double* y, int matSize) {
+	// Now x is given by the equations: L*y=b and U*x=y. The value of variable i ends up in x[P[i]]
+	for (int i=0;i<matSize;i++) {
+		y[P[i]] = b[P[i]];
+		for (int j=0;j<i;j++) {
+			y[P[i]]-=A[i][j]*y[P[j]];
+		}
+		y[P[i]]=y[P[i]]/1; // The diagonal of the lower triangular matrix is 1
+	}
+	for (int i=matSize-1;i>=0;i--) {
+		x[P[i]] = y[P[i]];
+		for (int j=i+1;j<matSize;j++) {
+			x[P[i]]-=A[i][j]*x[P[j]];
+		}
+		x[P[i]]=x[P[i]]/A[i][i];
+	}
+}
+
+#endif
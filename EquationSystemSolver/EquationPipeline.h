@@ -0,0 +1,218 @@
+//============================================================================
+// Name        : EquationPipeline.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef EQUATIONPIPELINE_H
+#define EQUATIONPIPELINE_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#ifndef PIPELINE_BATCH_LINES
+#define PIPELINE_BATCH_LINES 1024 // Lines handed from one stage to the next at a time
+#endif
+
+#ifndef PIPELINE_QUEUE_BATCHES
+#define PIPELINE_QUEUE_BATCHES 8 // Batches a stage may run ahead of the next one
+#endif
+
+/* Reads an equation file in one pass, with the stages running concurrently in their own threads and connected by
+ * bounded queues:
+ *
+ * reading lines -> tokenizing -> resolving variable names -> assembling (the calling thread)
+ *
+ * Since the file is only read once, the variables are numbered in the order they first appear, not by the row they
+ * are defined on (which may come later in the file). The assembler gets every equation with its terms as such
+ * variable ids, and translates them to columns with rowOfVariable once the whole file is read
+ */
+
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	void push(T&& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock,[this]{return items.size()<capacity;});
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+
+	bool pop(T& item) {
+		// Returns false once the queue is closed and empty
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock,[this]{return !items.empty() || closed;});
+		if (items.empty()) {return false;}
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed=true;
+		notEmpty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed;
+	std::deque<T> items;
+	std::mutex mutex;
+	std::condition_variable notFull,notEmpty;
+};
+
+struct TokenizedEquation {
+	std::string variable; // The variable on the left hand side
+	std::vector<std::string> terms; // The variables on the right hand side, as often as they occur
+	long long constant; // The sum of the constants on the right hand side
+};
+
+struct ParsedEquation {
+	int row;
+	std::vector<int> terms; // Variable ids of the terms on the right hand side, as often as they occur
+	long long constant;
+};
+
+static void tokenizeEquation(const std::string& line, std::istringstream& ss, TokenizedEquation& equation) {
+	std::string token;
+	equation.variable.clear();
+	equation.terms.clear();
+	equation.constant=0;
+	ss.str(line);
+	ss.clear();
+	ss >> equation.variable;
+	while (ss >> token) {
+		if (isalpha(token[0])) {equation.terms.push_back(token);}
+		else if (isdigit(token[0])) {equation.constant+=std::stoi(token);}
+	}
+}
+
+class VariableResolver {
+public:
+	// Numbers the variables in the order they first appear, and keeps track of the row each is defined on
+	VariableResolver(std::vector<std::string>& variableList, std::vector<int>& rowOfVariable) :
+			variableList(variableList), rowOfVariable(rowOfVariable), nrRows(0) {}
+
+	void resolve(const TokenizedEquation& tokenized, ParsedEquation& equation) {
+		int variable = idOf(tokenized.variable);
+		if (rowOfVariable[variable]==-1) {rowOfVariable[variable]=nrRows;} // If defined twice, the first row counts
+		variableList.push_back(tokenized.variable);
+
+		equation.row=nrRows++;
+		equation.constant=tokenized.constant;
+		equation.terms.clear();
+		for (size_t t=0;t<tokenized.terms.size();t++) {equation.terms.push_back(idOf(tokenized.terms[t]));}
+	}
+
+	bool allDefined(std::ostream& err) const {
+		for (size_t id=0;id<rowOfVariable.size();id++) {
+			if (rowOfVariable[id]==-1) {err << "Variable " << variableNames[id] << " is never defined" << std::endl; return false;}
+		}
+		return true;
+	}
+
+private:
+	int idOf(const std::string& name) {
+		auto inserted = variableMap.insert({name,(int)variableNames.size()});
+		if (inserted.second) {variableNames.push_back(name); rowOfVariable.push_back(-1);}
+		return inserted.first->second;
+	}
+
+	std::unordered_map<std::string, int> variableMap;
+	std::vector<std::string> variableNames; // By variable id
+	std::vector<std::string>& variableList;
+	std::vector<int>& rowOfVariable;
+	int nrRows;
+};
+
+static bool parseEquations(std::istream& in, std::vector<ParsedEquation>& equations, std::vector<std::string>& variableList,
+		std::vector<int>& rowOfVariable, std::ostream& err) {
+	/* The same as readEquationsPipelined, in the calling thread only, for small systems like the ones in batch mode.
+	 * The vectors are cleared first, and the terms of the equations already in equations are reused
+	 */
+	VariableResolver resolver(variableList,rowOfVariable);
+	TokenizedEquation tokenized;
+	std::istringstream ss;
+	std::string line;
+	size_t nrEquations=0;
+	variableList.clear();
+	rowOfVariable.clear();
+	while (getline(in,line)) {
+		tokenizeEquation(line,ss,tokenized);
+		if (nrEquations==equations.size()) {equations.push_back(ParsedEquation());}
+		resolver.resolve(tokenized,equations[nrEquations++]);
+	}
+	equations.resize(nrEquations);
+	return resolver.allDefined(err);
+}
+
+static bool readEquationsPipelined(const char* eqFileName, const std::function<void(ParsedEquation&)>& assemble,
+		std::vector<std::string>& variableList, std::vector<int>& rowOfVariable) {
+	/* Calls assemble for every equation, in file order. Afterwards variableList holds the variable of every row, and
+	 * rowOfVariable the row every variable id is defined on. Returns false if the file can't be read, or if a
+	 * variable is used but never defined
+	 */
+	std::ifstream inFile(eqFileName);
+	if (!inFile.is_open()) {std::cerr << "Unable to open file" << std::endl; return false;}
+
+	BoundedQueue<std::vector<std::string>> lineQueue(PIPELINE_QUEUE_BATCHES);
+	BoundedQueue<std::vector<TokenizedEquation>> tokenQueue(PIPELINE_QUEUE_BATCHES);
+	BoundedQueue<std::vector<ParsedEquation>> equationQueue(PIPELINE_QUEUE_BATCHES);
+	VariableResolver variables(variableList,rowOfVariable);
+
+	std::thread reader([&]() {
+		std::vector<std::string> batch;
+		std::string line;
+		while (getline(inFile,line)) {
+			batch.push_back(line);
+			if (batch.size()==PIPELINE_BATCH_LINES) {lineQueue.push(std::move(batch)); batch.clear();}
+		}
+		if (!batch.empty()) {lineQueue.push(std::move(batch));}
+		lineQueue.close();
+	});
+
+	std::thread tokenizer([&]() {
+		std::vector<std::string> lines;
+		std::istringstream ss;
+		while (lineQueue.pop(lines)) {
+			std::vector<TokenizedEquation> batch(lines.size());
+			for (size_t l=0;l<lines.size();l++) {tokenizeEquation(lines[l],ss,batch[l]);}
+			tokenQueue.push(std::move(batch));
+		}
+		tokenQueue.close();
+	});
+
+	std::thread resolver([&]() {
+		std::vector<TokenizedEquation> tokenized;
+		while (tokenQueue.pop(tokenized)) {
+			std::vector<ParsedEquation> batch(tokenized.size());
+			for (size_t l=0;l<tokenized.size();l++) {variables.resolve(tokenized[l],batch[l]);}
+			equationQueue.push(std::move(batch));
+		}
+		equationQueue.close();
+	});
+
+	std::vector<ParsedEquation> equations;
+	while (equationQueue.pop(equations)) {
+		for (size_t l=0;l<equations.size();l++) {assemble(equations[l]);}
+	}
+	reader.join();
+	tokenizer.join();
+	resolver.join();
+
+	return variables.allDefined(std::cerr);
+}
+
+#endif
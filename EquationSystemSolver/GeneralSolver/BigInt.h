@@ -0,0 +1,243 @@
+//============================================================================
+// Name        : BigInt.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef BIGINT_H
+#define BIGINT_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+
+/* Signed integers of any size, for the exact solver. The magnitude is stored in 32 bit limbs, least significant limb
+ * first and without leading zero limbs, so zero has no limbs. Only what the Chinese remaindering, the rational
+ * reconstruction and the verification of the solution need is implemented, with the schoolbook algorithms
+ */
+
+class BigInt {
+public:
+	BigInt() : negative(false) {}
+	BigInt(long long value) : negative(value<0) {
+		unsigned long long magnitude = negative ? 0-(unsigned long long)value : value;
+		while (magnitude) {limbs.push_back((uint32_t)magnitude); magnitude>>=32;}
+	}
+
+	bool isZero() const {return limbs.empty();}
+	bool isNegative() const {return negative;}
+	int bitLength() const {
+		if (limbs.empty()) {return 0;}
+		int bits = 32*(limbs.size()-1);
+		for (uint32_t top=limbs.back();top;top>>=1) {bits++;}
+		return bits;
+	}
+
+	BigInt abs() const {BigInt result(*this); result.negative=false; return result;}
+	BigInt operator-() const {BigInt result(*this); result.negative = !negative && !isZero(); return result;}
+
+	friend bool operator==(const BigInt& a, const BigInt& b) {return a.negative==b.negative && a.limbs==b.limbs;}
+	friend bool operator!=(const BigInt& a, const BigInt& b) {return !(a==b);}
+
+	static int compareMagnitude(const BigInt& a, const BigInt& b) {
+		if (a.limbs.size()!=b.limbs.size()) {return a.limbs.size()<b.limbs.size() ? -1 : 1;}
+		for (size_t i=a.limbs.size();i-->0;) {
+			if (a.limbs[i]!=b.limbs[i]) {return a.limbs[i]<b.limbs[i] ? -1 : 1;}
+		}
+		return 0;
+	}
+
+	friend BigInt operator+(const BigInt& a, const BigInt& b) {
+		if (a.negative==b.negative) {return withSign(addMagnitude(a.limbs,b.limbs),a.negative);}
+		if (compareMagnitude(a,b)>=0) {return withSign(subtractMagnitude(a.limbs,b.limbs),a.negative);}
+		return withSign(subtractMagnitude(b.limbs,a.limbs),b.negative);
+	}
+	friend BigInt operator-(const BigInt& a, const BigInt& b) {return a + (-b);}
+
+	friend BigInt operator*(const BigInt& a, const BigInt& b) {
+		if (a.isZero() || b.isZero()) {return BigInt();}
+		std::vector<uint32_t> product(a.limbs.size()+b.limbs.size(),0);
+		for (size_t i=0;i<a.limbs.size();i++) {
+			uint64_t carry=0;
+			for (size_t j=0;j<b.limbs.size();j++) {
+				uint64_t t = (uint64_t)a.limbs[i]*b.limbs[j] + product[i+j] + carry;
+				product[i+j] = (uint32_t)t;
+				carry = t>>32;
+			}
+			product[i+b.limbs.size()] = (uint32_t)carry;
+		}
+		return withSign(product,a.negative!=b.negative);
+	}
+
+	static void divMod(const BigInt& a, const BigInt& b, BigInt& quotient, BigInt& remainder) {
+		// Truncating division like for ints, the remainder gets the sign of a. b must not be zero
+		std::vector<uint32_t> q,r;
+		divModMagnitude(a.limbs,b.limbs,q,r);
+		quotient = withSign(q,a.negative!=b.negative);
+		remainder = withSign(r,a.negative);
+	}
+
+	static BigInt mod(const BigInt& a, const BigInt& m) {
+		// a mod m in [0,m), for positive m
+		BigInt quotient,remainder;
+		divMod(a,m,quotient,remainder);
+		if (remainder.negative) {remainder = remainder + m;}
+		return remainder;
+	}
+
+	static BigInt gcd(BigInt a, BigInt b) {
+		BigInt quotient,remainder;
+		a.negative=false;
+		b.negative=false;
+		while (!b.isZero()) {
+			divMod(a,b,quotient,remainder);
+			a=b;
+			b=remainder;
+		}
+		return a;
+	}
+
+	uint32_t modSmall(uint32_t m) const {
+		// The non negative residue modulo m
+		uint64_t r=0;
+		for (size_t i=limbs.size();i-->0;) {r = ((r<<32) | limbs[i]) % m;}
+		if (negative && r) {r = m-r;}
+		return (uint32_t)r;
+	}
+
+	std::string toString() const {
+		if (isZero()) {return "0";}
+		std::vector<uint32_t> magnitude(limbs);
+		std::string digits;
+		while (!magnitude.empty()) {
+			// Divide by 10^9 and print the remainder as nine digits
+			uint64_t r=0;
+			for (size_t i=magnitude.size();i-->0;) {
+				uint64_t t = (r<<32) | magnitude[i];
+				magnitude[i] = (uint32_t)(t/1000000000);
+				r = t%1000000000;
+			}
+			trim(magnitude);
+			for (int d=0;d<9 && (r || !magnitude.empty());d++) {digits.push_back('0' + r%10); r/=10;}
+		}
+		if (negative) {digits.push_back('-');}
+		std::reverse(digits.begin(),digits.end());
+		return digits;
+	}
+
+private:
+	static BigInt withSign(std::vector<uint32_t>& magnitude, bool negative) {
+		BigInt result;
+		trim(magnitude);
+		result.limbs.swap(magnitude);
+		result.negative = negative && !result.limbs.empty();
+		return result;
+	}
+	static BigInt withSign(std::vector<uint32_t>&& magnitude, bool negative) {return withSign(magnitude,negative);}
+
+	static void trim(std::vector<uint32_t>& magnitude) {
+		while (!magnitude.empty() && magnitude.back()==0) {magnitude.pop_back();}
+	}
+
+	static std::vector<uint32_t> addMagnitude(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+		const std::vector<uint32_t>& longer = (a.size()>=b.size()) ? a : b;
+		const std::vector<uint32_t>& shorter = (a.size()>=b.size()) ? b : a;
+		std::vector<uint32_t> sum(longer.size()+1);
+		uint64_t carry=0;
+		for (size_t i=0;i<longer.size();i++) {
+			uint64_t t = (uint64_t)longer[i] + (i<shorter.size() ? shorter[i] : 0) + carry;
+			sum[i] = (uint32_t)t;
+			carry = t>>32;
+		}
+		sum[longer.size()] = (uint32_t)carry;
+		return sum;
+	}
+
+	static std::vector<uint32_t> subtractMagnitude(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+		// |a| >= |b|
+		std::vector<uint32_t> difference(a.size());
+		int64_t borrow=0;
+		for (size_t i=0;i<a.size();i++) {
+			int64_t t = (int64_t)a[i] - (i<b.size() ? b[i] : 0) - borrow;
+			borrow = (t<0) ? 1 : 0;
+			difference[i] = (uint32_t)(t + (borrow<<32));
+		}
+		return difference;
+	}
+
+	static void divModMagnitude(const std::vector<uint32_t>& u, const std::vector<uint32_t>& v, std::vector<uint32_t>& q, std::vector<uint32_t>& r) {
+		// Knuth's algorithm D (The Art of Computer Programming, vol 2, 4.3.1), on 32 bit limbs
+		int n = v.size(), m = (int)u.size()-n;
+		if (m<0) {q.clear(); r=u; return;}
+		q.assign(m+1,0);
+
+		if (n==1) {
+			uint64_t rem=0;
+			for (int i=u.size()-1;i>=0;i--) {
+				uint64_t t = (rem<<32) | u[i];
+				q[i] = (uint32_t)(t/v[0]);
+				rem = t%v[0];
+			}
+			r.assign(1,(uint32_t)rem);
+			trim(r);
+			return;
+		}
+
+		// Normalize, so that the top limb of v has its high bit set
+		int shift=0;
+		while (!((v[n-1]<<shift) & 0x80000000)) {shift++;}
+		std::vector<uint32_t> vn(n), un(u.size()+1);
+		for (int i=n-1;i>0;i--) {vn[i] = (v[i]<<shift) | (shift ? (uint32_t)((uint64_t)v[i-1]>>(32-shift)) : 0);}
+		vn[0] = v[0]<<shift;
+		un[u.size()] = shift ? (uint32_t)((uint64_t)u.back()>>(32-shift)) : 0;
+		for (int i=u.size()-1;i>0;i--) {un[i] = (u[i]<<shift) | (shift ? (uint32_t)((uint64_t)u[i-1]>>(32-shift)) : 0);}
+		un[0] = u[0]<<shift;
+
+		for (int j=m;j>=0;j--) {
+			// Estimate the quotient limb from the top two limbs, it is at most 2 too large
+			uint64_t numerator = ((uint64_t)un[j+n]<<32) | un[j+n-1];
+			uint64_t qhat = numerator/vn[n-1], rhat = numerator%vn[n-1];
+			while (qhat>>32 || qhat*vn[n-2] > ((rhat<<32) | un[j+n-2])) {
+				qhat--;
+				rhat+=vn[n-1];
+				if (rhat>>32) {break;}
+			}
+
+			// Multiply and subtract
+			int64_t borrow=0,t;
+			uint64_t carry=0;
+			for (int i=0;i<n;i++) {
+				uint64_t p = qhat*vn[i] + carry;
+				carry = p>>32;
+				t = (int64_t)un[i+j] - borrow - (int64_t)(p & 0xffffffff);
+				un[i+j] = (uint32_t)t;
+				borrow = (t<0) ? 1 : 0;
+			}
+			t = (int64_t)un[j+n] - borrow - (int64_t)carry;
+			un[j+n] = (uint32_t)t;
+
+			if (t<0) {
+				// Subtracted one time too many, add back
+				qhat--;
+				carry=0;
+				for (int i=0;i<n;i++) {
+					uint64_t s = (uint64_t)un[i+j] + vn[i] + carry;
+					un[i+j] = (uint32_t)s;
+					carry = s>>32;
+				}
+				un[j+n] += (uint32_t)carry;
+			}
+			q[j] = (uint32_t)qhat;
+		}
+
+		r.assign(n,0);
+		for (int i=0;i<n;i++) {r[i] = (un[i]>>shift) | (shift ? (uint32_t)((uint64_t)un[i+1]<<(32-shift)) : 0);}
+		trim(q);
+		trim(r);
+	}
+
+	std::vector<uint32_t> limbs;
+	bool negative;
+};
+
+#endif
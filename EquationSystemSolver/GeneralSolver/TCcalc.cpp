@@ -10,7 +10,22 @@
 #include <vector>
 #include <string> // std::stoi
 #include <algorithm>
+#include <future>
+#include <atomic>
 #include <math.h>
+#include <stdlib.h> // mkstemp
+#include <fcntl.h>
+#include <unistd.h> // pread, pwrite
+#include "../NumaPlacement.h"
+#include "../EquationPipeline.h"
+#include "../BlockTriangular.h"
+#include "../BatchPool.h"
+#include "../DenseLU.h"
+#include "BigInt.h"
+
+#ifndef EXACT_PRIME_BITS
+#define EXACT_PRIME_BITS 26 // The exact solver uses primes below 2^EXACT_PRIME_BITS, at most 26
+#endif
 
 /* This program solves the system of linear equations on the form Ax=b by reading custom
  * variable names and equations from a file, solving them, and then prints their values. It LU decomposition
@@ -18,154 +33,920 @@
  * and here: http://cseweb.ucsd.edu/~baden/classes/Exemplars/260_fa06/Ricketts_SR.pdf
  */
 
-static inline bool isZero(double val) {
-	/* In large equation systems rounding errors becomes a factor. When doing LU factorization, it is possible to encounter
-	 * diagonal value that should be zero, but is instead very close to zero, due to rounding errors in the calculations.
-	 * Example: 1 - 1/3 * 3 is zero in math world, but 0.0000000...1 in computer world, since 1/3 is represented as
-	 * 0.333333333... Therefore this function decides whether a value is zero or not
-	 */
+/* Out of core mode. The matrix is stored in a scratch file as column panels of panelWidth columns. Each panel
+ * holds all matSize rows, row major, so panel p is the rows [0,matSize) x columns [p*panelWidth,(p+1)*panelWidth).
+ * The factorization is left looking: every panel is loaded once, updated with all the panels to the left of it,
+ * factorized (with partial pivoting within the panel) and written back. Only three panels are held in memory at a
+ * time, the one being factorized, the one it is updated with, and the next one, which is read in the background
+ * while the update runs. During the last update the next panel to factorize is read instead, and it goes on being
+ * read while the current one is factorized and written back. Row swaps are only applied to the panels in memory, so a panel on disk has the rows in
+ * the order they had when it was factorized, and later swaps are replayed on it when it is read again
+ */
+
+struct ScratchMatrix {
+	int fd;
+	int matSize,panelWidth,nrPanels;
+
+	int width(int panel) const {return std::min(panelWidth,matSize-panel*panelWidth);}
+	off_t offset(int panel) const {return (off_t)panel*panelWidth*matSize*sizeof(double);}
+};
+
+static bool fullIO(bool write, int fd, double* buf, size_t bytes, off_t offset) {
+	char* pos = (char*) buf;
+	while (bytes>0) {
+		ssize_t done = write ? pwrite(fd,pos,bytes,offset) : pread(fd,pos,bytes,offset);
+		if (done<=0) {return false;}
+		pos+=done;
+		bytes-=done;
+		offset+=done;
+	}
+	return true;
+}
+
+static void applySwaps(double* panel, int width, const int* pivots, int fromCol, int toCol) {
+	// Replays the row swaps done when factorizing columns [fromCol,toCol) on a panel held in memory
+	for (int col=fromCol;col<toCol;col++) {
+		if (pivots[col]!=col) {std::swap_ranges(panel+(size_t)col*width,panel+(size_t)(col+1)*width,panel+(size_t)pivots[col]*width);}
+	}
+}
 
-	if (fabs(val)<0.000001) {return true;}
-	return false;
+static bool readPanel(const ScratchMatrix& M, int panel, double* buf, const int* pivots, int swapsFrom, int swapsTo) {
+	if (!fullIO(false,M.fd,buf,(size_t)M.width(panel)*M.matSize*sizeof(double),M.offset(panel))) {return false;}
+	applySwaps(buf,M.width(panel),pivots,swapsFrom,swapsTo);
+	return true;
 }
 
-static bool LUPfactorize(double** A, int* P, int matSize) {
-	/* Factorizes the matrix A into a lower and upper triangular matrix and stores it in A. When
-	 * the algorithm is complete. A will constitute of an upper and lower triangular matrix A = L+U
-	 * The diagonal of A belongs to the upper matrix. The diagonal of the lower matrix consists of ones
+static void updatePanel(double* K, int kWidth, const double* J, int jCol, int jWidth, int matSize) {
+	/* Applies the factorized panel J (columns [jCol,jCol+jWidth)) to the panel K, which lies to the right of it. First the
+	 * rows of K next to J's diagonal block are solved with J's unit lower triangle, then the rows below are updated.
+	 * The panels can hold more than 2^31 values, so the row offsets are size_t
 	 */
+	for (int row=jCol;row<matSize;row++) {
+		double* kRow = K + (size_t)row*kWidth;
+		const double* jRow = J + (size_t)row*jWidth - jCol;
+		int end = std::min(row,jCol+jWidth);
+		for (int t=jCol;t<end;t++) {
+			double l = jRow[t];
+			if (l==0) {continue;} // The systems are sparse, a lot of the multipliers stay zero
+			const double* kT = K + (size_t)t*kWidth;
+			for (int c=0;c<kWidth;c++) {kRow[c] -= l * kT[c];}
+		}
+	}
+}
 
-	int swapRoxIndex,tempPval;
-	double* tempRowPointer,maxValInCol;
+static bool factorizePanel(double* K, int kCol, int kWidth, int* pivots, int matSize) {
+	// LU factorizes the columns of the panel at and below the diagonal, with partial pivoting
+	for (int c=0;c<kWidth;c++) {
+		int col = kCol+c, pivotRow=col;
+		for (int row=col+1;row<matSize;row++) {
+			if (fabs(K[(size_t)row*kWidth + c])>fabs(K[(size_t)pivotRow*kWidth + c])) {pivotRow=row;}
+		}
+		if (isZero(K[(size_t)pivotRow*kWidth + c])) {
+			std::cout << "Matrix is singular to working precision" << std::endl;
+			return false;
+		}
+		pivots[col]=pivotRow;
+		double* pivot = K + (size_t)col*kWidth;
+		if (pivotRow!=col) {std::swap_ranges(pivot,pivot+kWidth,K + (size_t)pivotRow*kWidth);}
 
-	for (int i = 0; i < matSize; i++) {P[i] = i;} // Set the permutation matrix to identity
+		for (int row=col+1;row<matSize;row++) {
+			double* kRow = K + (size_t)row*kWidth;
+			if (kRow[c]==0) {continue;}
+			kRow[c] /= pivot[c];
+			for (int c2=c+1;c2<kWidth;c2++) {kRow[c2] -= kRow[c] * pivot[c2];}
+		}
+	}
+	return true;
+}
 
-	for (int col=0; col<matSize-1; col++) {
-		if (isZero(A[col][col])) {
-			/* If the diagonal of A is zero, then we need to permutate the matrix to avoid dividing by zero. If all the entries in
-			 * A[-][col] are zero then the matrix A is singular, and the equation system has no (or an infinite
-			 * number of) solutions
+static bool outOfCoreFactorize(const ScratchMatrix& M, int* pivots, double* bufs[3]) {
+	double* K = bufs[0],* J = bufs[1],* nextJ = bufs[2];
+	std::future<bool> prefetch,nextK;
+
+	if (!readPanel(M,0,K,pivots,0,0)) {std::cerr << "Unable to read scratch file" << std::endl; return false;}
+	for (int k=0;k<M.nrPanels;k++) {
+		int kCol = k*M.panelWidth, kWidth = M.width(k);
+		auto readNextK = [&]() {
+			/* nextJ is free from the last update of K on, so the next K is read into it while this one is updated,
+			 * factorized and written. The swaps of this panel are replayed on it once they are known
 			 */
-			maxValInCol=0;
-			swapRoxIndex = col;
-			for (int row=col+1;row<matSize;row++) {
-//				if (!isZero(A[row][col])) {
-//					/* Normally you want to find the _largest_ absolute value in A[row=col+1 to row = matSize-1][col] here, which gives
-//					 * higher precision in the answer; however i choose the first non-zero value, which takes less time, without sacrificing
-//					 * much accuracy
-//					 */
-//					swapRoxIndex = row;
-//					break;
-//				}
-				// Get the largest value in the column
-				if (fabs(A[row][col])>fabs(maxValInCol)) {
-					maxValInCol = A[row][col];
-					swapRoxIndex = row;
+			if (k+1<M.nrPanels) {nextK = std::async(std::launch::async,readPanel,std::cref(M),k+1,nextJ,pivots,0,kCol);}
+		};
+
+		if (k>0) {
+			if (!readPanel(M,0,J,pivots,M.width(0),kCol)) {std::cerr << "Unable to read scratch file" << std::endl; return false;}
+			for (int j=0;j<k;j++) {
+				// Read the next panel while this one is applied
+				if (j+1<k) {prefetch = std::async(std::launch::async,readPanel,std::cref(M),j+1,nextJ,pivots,(j+1)*M.panelWidth+M.width(j+1),kCol);}
+				else {readNextK();}
+				updatePanel(K,kWidth,J,j*M.panelWidth,M.width(j),M.matSize);
+				if (j+1<k) {
+					if (!prefetch.get()) {std::cerr << "Unable to read scratch file" << std::endl; return false;}
+					std::swap(J,nextJ);
 				}
 			}
-			if (isZero(maxValInCol)) {
-				std::cout << "Matrix is singular to working precision" << std::endl;
-				return false;
-			}
-			// Pointer swap the rows in A
-			tempRowPointer = A[col];
-			A[col] = A[swapRoxIndex];
-			A[swapRoxIndex] = tempRowPointer;
+		}
+		else {readNextK();}
 
-			tempPval = P[col];
-			P[col]= P[swapRoxIndex];
-			P[swapRoxIndex] = tempPval;
+		if (!factorizePanel(K,kCol,kWidth,pivots,M.matSize)) {return false;}
+		if (!fullIO(true,M.fd,K,(size_t)kWidth*M.matSize*sizeof(double),M.offset(k))) {
+			std::cerr << "Unable to write scratch file" << std::endl;
+			return false;
 		}
+		if (k+1<M.nrPanels) {
+			if (!nextK.get()) {std::cerr << "Unable to read scratch file" << std::endl; return false;}
+			applySwaps(nextJ,M.width(k+1),pivots,kCol,kCol+kWidth);
+			std::swap(K,nextJ);
+		}
+	}
+	return true;
+}
 
-		for (int row=col+1;row<matSize;row++) {
-			/* This is the standard LU factorization algorithm, described here:
-			 * https://equilibriumofnothing.files.wordpress.com/2013/10/matrix_factorlup.png or here:
-			 * http://cseweb.ucsd.edu/~baden/classes/Exemplars/260_fa06/Ricketts_SR.pdf
-			 */
-			A[row][col] /= A[col][col];
-			for (int col2=col+1;col2<matSize;col2++) {
-				A[row][col2] = A[row][col2] - A[col][col2] * A[row][col];
-			}
+static bool outOfCoreSolve(const ScratchMatrix& M, const int* pivots, double* bufs[3], double* b, double* x) {
+	// Solves L*y=P*b and U*x=y, streaming the panels once forwards and once backwards
+	std::future<bool> prefetch;
+	double* J = bufs[0],* nextJ = bufs[1];
+
+	for (int col=0;col<M.matSize;col++) {std::swap(b[col],b[pivots[col]]);}
+
+	if (!readPanel(M,0,J,pivots,M.width(0),M.matSize)) {return false;}
+	for (int j=0;j<M.nrPanels;j++) {
+		int jCol = j*M.panelWidth, jWidth = M.width(j);
+		if (j+1<M.nrPanels) {prefetch = std::async(std::launch::async,readPanel,std::cref(M),j+1,nextJ,pivots,jCol+jWidth+M.width(j+1),M.matSize);}
+		for (int t=jCol;t<jCol+jWidth;t++) {
+			for (int row=t+1;row<M.matSize;row++) {b[row] -= J[(size_t)row*jWidth + t-jCol] * b[t];}
+		}
+		if (j+1<M.nrPanels) {
+			if (!prefetch.get()) {return false;}
+			std::swap(J,nextJ);
 		}
 	}
 
-	/* At this stage, A[matSize-1][matSize-1] may be zero, since the outermost col-iterating loop doesnt
-	 * go through the last column (by design). Therefore, it doesn't check if A[matSize-1][matSize-1] or try to permutate it.
-	 * The check is instead done here. If this check is passed, all diagonal values in A (which is the same as the diagonal
-	 * in the upper triangular matrix) are guaranteed to be non-zero
-	 */
-	if (isZero(A[matSize-1][matSize-1])) {
-		std::cout << "Matrix is singular to working precision" << std::endl;
-		return false;
+	// The rows of U are above the diagonal, so the swaps of later panels never touch them
+	if (!readPanel(M,M.nrPanels-1,J,pivots,0,0)) {return false;}
+	for (int j=M.nrPanels-1;j>=0;j--) {
+		int jCol = j*M.panelWidth, jWidth = M.width(j);
+		if (j>0) {prefetch = std::async(std::launch::async,readPanel,std::cref(M),j-1,nextJ,pivots,0,0);}
+		for (int t=jCol+jWidth-1;t>=jCol;t--) {
+			x[t] = b[t] / J[(size_t)t*jWidth + t-jCol];
+			for (int row=0;row<t;row++) {b[row] -= J[(size_t)row*jWidth + t-jCol] * x[t];}
+		}
+		if (j>0) {
+			if (!prefetch.get()) {return false;}
+			std::swap(J,nextJ);
+		}
 	}
 	return true;
 }
 
-int main(int argc, char** argv) {
-	if (argc<2) {std::cerr << "No equation file provided in command line argument" << std::endl; return -1;}
-
-	// Start by reading the input file
+static int solveOutOfCore(const char* eqFileName, size_t memoryBudget, const char* scratchFileName) {
 	std::unordered_map<std::string, int> variableMap;
 	std::vector<std::string> variableList;
 	std::ifstream inFile;
 	std::istringstream ss;
 	std::string line,token;
+	ScratchMatrix M;
+	int matSize=0;
 
-	double** A,* b,* x,* y;
-	int* P;
+	inFile.open(eqFileName);
+	if (!inFile.is_open()) {std::cerr << "Unable to open file" << std::endl; return -1;}
+	while (getline(inFile,line)) {
+		ss.str(line);
+		ss.clear();
+		ss >> token;
+		variableMap.insert({token,matSize});
+		variableList.push_back(token);
+		matSize++;
+	}
+	if (matSize==0) {std::cerr << "No equations in input file" << std::endl;return-1;}
 
-	int lineIndex=0,matSize=0;
-	bool firstToken=true;
+	// Three panels have to fit in the budget
+	M.matSize = matSize;
+	M.panelWidth = std::min((size_t)matSize,memoryBudget / (3*sizeof(double)*matSize));
+	if (M.panelWidth<1) {std::cerr << "Memory budget too small for " << matSize << " equations" << std::endl; return -1;}
+	M.nrPanels = (matSize+M.panelWidth-1) / M.panelWidth;
 
-	inFile.open(argv[1]);
-	if (inFile.is_open()) {
-		while (getline(inFile,line)) {
-			ss.str(line);
-			ss.clear();
-			ss >> token;
-			variableMap.insert({token,lineIndex});
-			variableList.push_back(token);
-			lineIndex++;
-		}
-		matSize=lineIndex;
-		if (matSize==0) {std::cerr << "No equations in input file" << std::endl;return-1;}
-
-		// Allocate the matrices, zero initialized with ()
-		A = new double*[matSize];
-		for (int i = 0; i < matSize; ++i) {A[i] = new double[matSize]();}
-		b = new double[matSize]();
-		x = new double[matSize]();
-		y = new double[matSize]();
-		P = new int[matSize](); // Permutation vector
-
-		inFile.clear();
-		inFile.seekg(std::ios::beg); // Reset file pointer
-		lineIndex=0;
-
-		while (getline(inFile,line)) {
-			A[lineIndex][lineIndex]=1;
+	if (scratchFileName) {M.fd = open(scratchFileName,O_RDWR | O_CREAT | O_TRUNC,0600);}
+	else {
+		char tempName[] = "TCcalcScratchXXXXXX";
+		M.fd = mkstemp(tempName);
+		if (M.fd>=0) {unlink(tempName);} // Removed when the program exits
+	}
+	if (M.fd<0) {std::cerr << "Unable to create scratch file" << std::endl; return -1;}
+
+	double* b = new double[matSize]();
+	double* x = new double[matSize]();
+	int* pivots = new int[matSize];
+
+	/* Assemble the matrix block of rows by block of rows, as many rows as fit in the budget. The row buffer is laid
+	 * out panel by panel, so that the part of every panel can be written with one call
+	 */
+	int rowsPerBlock = std::max((size_t)1,std::min((size_t)matSize,memoryBudget / (sizeof(double)*matSize)));
+	double* rowBuf = new double[(size_t)rowsPerBlock*matSize];
+
+	inFile.clear();
+	inFile.seekg(std::ios::beg); // Reset file pointer
+	bool ioOk=true;
+	for (int blockStart=0;blockStart<matSize && ioOk;blockStart+=rowsPerBlock) {
+		int blockRows = std::min(rowsPerBlock,matSize-blockStart);
+		std::fill(rowBuf,rowBuf+(size_t)blockRows*matSize,0.0);
+
+		for (int r=0;r<blockRows && getline(inFile,line);r++) {
+			int row = blockStart+r;
+			bool firstToken=true;
 			ss.str(line);
 			ss.clear();
 			while (ss >> token) {
 				if (firstToken) {firstToken=false;continue;}
-
 				if (isalpha(token[0])) {
-					A[lineIndex][variableMap.at(token)]--; // Subtract 1 from the matrix 'A'
+					int col = variableMap.at(token);
+					int panel = col/M.panelWidth;
+					rowBuf[(size_t)panel*M.panelWidth*blockRows + (size_t)r*M.width(panel) + col%M.panelWidth]--;
 				}
-				else if (isdigit(token[0])) {
-					b[lineIndex]+=std::stoi(token);
+				else if (isdigit(token[0])) {b[row]+=std::stoi(token);}
+			}
+			int panel = row/M.panelWidth;
+			rowBuf[(size_t)panel*M.panelWidth*blockRows + (size_t)r*M.width(panel) + row%M.panelWidth]+=1; // The variable on the left hand side
+		}
+
+		for (int panel=0;panel<M.nrPanels && ioOk;panel++) {
+			ioOk = fullIO(true,M.fd,&rowBuf[(size_t)panel*M.panelWidth*blockRows],(size_t)blockRows*M.width(panel)*sizeof(double),
+					M.offset(panel) + (off_t)blockStart*M.width(panel)*sizeof(double));
+		}
+	}
+	inFile.close();
+	delete[] rowBuf;
+
+	double* bufs[3];
+	for (int i=0;i<3;i++) {bufs[i] = new double[(size_t)M.panelWidth*matSize];}
+
+	int result=-1;
+	if (!ioOk) {std::cerr << "Unable to write scratch file" << std::endl;}
+	else if (outOfCoreFactorize(M,pivots,bufs)) {
+		if (!outOfCoreSolve(M,pivots,bufs,b,x)) {std::cerr << "Unable to read scratch file" << std::endl;}
+		else {
+			// Associate each variable string with its value:
+			std::vector<std::pair<std::string,double>> varPairs;
+			varPairs.reserve(matSize);
+			for (int i=0;i<matSize;i++) {
+				varPairs.push_back(std::make_pair(variableList[i],x[i]));
+			}
+
+			// Sort the strings:
+			sort( varPairs.begin(), varPairs.end());
+
+			// Print the result:
+			for (int i=0;i<matSize;i++) {
+				std::cout << varPairs[i].first << " = " << varPairs[i].second << std::endl;
+			}
+			result=0;
+		}
+	}
+
+	close(M.fd);
+	for (int i=0;i<3;i++) {delete[] bufs[i];}
+	delete[] b;
+	delete[] x;
+	delete[] pivots;
+	return result;
+}
+
+static int solveBlockTriangular(const char* eqFileName, WorkerPool* pool) {
+	/* Block triangular mode (-btf), see BlockTriangular.h. Blocks of one row are solved by substitution, larger
+	 * blocks with LU factorization of the block. The blocks of a level are divided between the threads, unless there
+	 * is only one, which then gets all the threads for its factorization
+	 */
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable;
+	std::vector<ParsedEquation> equations;
+
+	bool readOk = readEquationsPipelined(eqFileName,[&](ParsedEquation& equation) {
+		equations.push_back(std::move(equation));
+	},variableList,rowOfVariable);
+	if (!readOk) {return -1;}
+	int matSize=equations.size();
+	if (matSize==0) {std::cerr << "No equations in input file" << std::endl;return-1;}
+
+	// The sparse matrix, with the diagonal kept apart
+	std::vector<int> rowStart(1,0),cols;
+	std::vector<double> coefs,diagonal(matSize,1),b(matSize);
+	for (int i=0;i<matSize;i++) {
+		std::vector<int>& terms = equations[i].terms;
+		for (size_t t=0;t<terms.size();t++) {terms[t]=rowOfVariable[terms[t]];}
+		sort(terms.begin(),terms.end());
+		for (size_t t=0;t<terms.size();t++) {
+			if (terms[t]==i) {diagonal[i]--;}
+			else if (t>0 && terms[t]==terms[t-1]) {coefs.back()--;}
+			else {cols.push_back(terms[t]); coefs.push_back(-1);}
+		}
+		rowStart.push_back(cols.size());
+		b[i]=equations[i].constant;
+	}
+	equations.clear();
+
+	BlockDecomposition blocks;
+	findBlocks(matSize,rowStart,cols,blocks);
+	std::vector<int> blockOf(matSize),localIndex(matSize);
+	for (int k=0;k<blocks.nrBlocks();k++) {
+		for (int r=blocks.blockStart[k];r<blocks.blockStart[k+1];r++) {
+			blockOf[blocks.rows[r]]=k;
+			localIndex[blocks.rows[r]]=r-blocks.blockStart[k];
+		}
+	}
+
+	std::vector<double> x(matSize);
+	std::atomic<bool> singular(false);
+	auto solveBlock = [&](int k, WorkerPool* blockPool) {
+		if (singular) {return;}
+		int size = blocks.blockSize(k);
+		const int* blockRows = &blocks.rows[blocks.blockStart[k]];
+
+		if (size==1) {
+			// Substitution
+			int row = blockRows[0];
+			double rhs = b[row];
+			for (int c=rowStart[row];c<rowStart[row+1];c++) {rhs -= coefs[c]*x[cols[c]];}
+			if (isZero(diagonal[row])) {singular=true; return;}
+			x[row] = rhs/diagonal[row];
+			return;
+		}
+
+		// The block as a dense system, with the variables of the earlier blocks moved to the right hand side
+		double** A = new double*[size];
+		double* rhs = new double[size];
+		double* xBlock = new double[size];
+		double* yBlock = new double[size];
+		int* P = new int[size];
+		for (int r=0;r<size;r++) {
+			int row = blockRows[r];
+			A[r] = new double[size]();
+			A[r][r] = diagonal[row];
+			rhs[r] = b[row];
+			for (int c=rowStart[row];c<rowStart[row+1];c++) {
+				if (blockOf[cols[c]]==k) {A[r][localIndex[cols[c]]] += coefs[c];}
+				else {rhs[r] -= coefs[c]*x[cols[c]];}
+			}
+		}
+		if (!LUPfactorize(A,P,size,blockPool)) {singular=true;}
+		else {
+			LUPsolve(A,P,rhs,xBlock,yBlock,size);
+			for (int r=0;r<size;r++) {x[blockRows[r]] = xBlock[P[r]];}
+		}
+		for (int r=0;r<size;r++) {delete[] A[r];}
+		delete[] A;
+		delete[] rhs;
+		delete[] xBlock;
+		delete[] yBlock;
+		delete[] P;
+	};
+
+	for (int l=0;l<blocks.nrLevels() && !singular;l++) {
+		int firstBlock = blocks.levelStart[l], endBlock = blocks.levelStart[l+1];
+		if (!pool || endBlock-firstBlock==1) {
+			for (int k=firstBlock;k<endBlock;k++) {solveBlock(k,pool);}
+		}
+		else {
+			pool->run([&](int w) {
+				for (int k=firstBlock+w;k<endBlock;k+=pool->size()) {solveBlock(k,NULL);}
+			});
+		}
+	}
+	if (singular) {std::cout << "Matrix is singular to working precision" << std::endl; return -1;}
+
+	// Associate each variable string with its value:
+	std::vector<std::pair<std::string,double>> varPairs;
+	varPairs.reserve(matSize);
+	for (int i=0;i<matSize;i++) {
+		varPairs.push_back(std::make_pair(variableList[i],x[i]));
+	}
+
+	// Sort the strings:
+	sort( varPairs.begin(), varPairs.end());
+
+	// Print the result:
+	for (int i=0;i<matSize;i++) {
+		std::cout << varPairs[i].first << " = " << varPairs[i].second << std::endl;
+	}
+	return 0;
+}
+
+struct BatchBuffers {
+	// What a batch thread reuses between the systems it solves
+	std::vector<ParsedEquation> equations;
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable,P;
+	std::vector<double> matrix,b,x,y;
+	std::vector<double*> rows;
+	std::vector<std::pair<std::string,double>> varPairs;
+};
+
+static void solveBatchSystem(const std::string& system, BatchBuffers& buffers, BatchResult& result) {
+	// Solves one system of a batch, into what would have been printed to stdout and stderr
+	std::istringstream in(system);
+	std::ostringstream out,err;
+	if (!parseEquations(in,buffers.equations,buffers.variableList,buffers.rowOfVariable,err)) {result.err=err.str(); return;}
+	int matSize=buffers.equations.size();
+	if (matSize==0) {result.err="No equations in input file\n"; return;}
+
+	buffers.matrix.assign((size_t)matSize*matSize,0);
+	buffers.rows.resize(matSize);
+	buffers.b.resize(matSize);
+	buffers.x.resize(matSize);
+	buffers.y.resize(matSize);
+	buffers.P.resize(matSize);
+	for (int i=0;i<matSize;i++) {
+		double* row = buffers.rows[i] = &buffers.matrix[(size_t)i*matSize];
+		row[i]=1;
+		const ParsedEquation& equation = buffers.equations[i];
+		for (size_t t=0;t<equation.terms.size();t++) {row[buffers.rowOfVariable[equation.terms[t]]]--;}
+		buffers.b[i]=equation.constant;
+	}
+
+	if (!LUPfactorize(buffers.rows.data(),buffers.P.data(),matSize)) {result.out="Matrix is singular to working precision\n"; return;}
+	LUPsolve(buffers.rows.data(),buffers.P.data(),buffers.b.data(),buffers.x.data(),buffers.y.data(),matSize);
+
+	buffers.varPairs.clear();
+	for (int i=0;i<matSize;i++) {
+		buffers.varPairs.push_back(std::make_pair(buffers.variableList[i],buffers.x[buffers.P[i]]));
+	}
+	sort(buffers.varPairs.begin(),buffers.varPairs.end());
+	for (int i=0;i<matSize;i++) {
+		out << buffers.varPairs[i].first << " = " << buffers.varPairs[i].second << '\n';
+	}
+	result.out=out.str();
+}
+
+static int solveBatch(const char* batchFileName, int nrThreads) {
+	// Batch mode (-batch), see BatchPool.h. The file name - reads the systems from stdin
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::ifstream inFile;
+	bool fromStdin = std::string(batchFileName)=="-";
+	if (!fromStdin) {
+		inFile.open(batchFileName);
+		if (!inFile.is_open()) {std::cerr << "Unable to open file" << std::endl; return -1;}
+	}
+
+	std::vector<BatchBuffers> buffers(nrThreads);
+	int nrSystems = WorkStealingPool::run(fromStdin ? std::cin : inFile,nrThreads,[&](const std::string& system, int thread, BatchResult& result) {
+		solveBatchSystem(system,buffers[thread],result);
+	},printBatchResult);
+	std::cout.flush();
+	reportThroughput(nrSystems,start);
+	return 0;
+}
+
+/* Exact solver (-exact). The integer matrix is LU factorized once modulo a word sized prime p, on all threads, and
+ * the solution is found p-adically with Dixon lifting: x = x0 + x1*p + x2*p^2 + ..., where every digit xk = A^-1 rk
+ * mod p comes from the factorization with one forward and one back substitution, and the residual
+ * r(k+1) = (rk - A xk)/p is exact in 64 bit integers. A lifting step costs O(n^2), so the factorization dominates
+ * like in the floating point solver. The rational solution is found from x mod p^k with rational reconstruction, and
+ * is then checked exactly against the equations. Steps are added until the check succeeds, so their number grows
+ * with the size of the numerators and denominators of the solution, not with a worst case bound.
+ *
+ * If A is singular modulo p, either p divides the determinant or A is singular. Then A is solved modulo more primes,
+ * one per thread, until one of them factorizes it, or until a vector in the kernel of A, put together from the
+ * primes with the Chinese remainder theorem and rational reconstruction, is checked exactly, which proves that A is
+ * singular
+ */
+
+static inline double reduceMod(double value, double p, double pInverse) {
+	/* value mod p, in the symmetric range [-p/2,p/2] (give or take one). Residues are kept in that range, so the
+	 * products of two of them are below 2^(2*EXACT_PRIME_BITS-2) and exact in a double. The quotient is rounded to
+	 * nearest with the 1.5*2^52 trick, and there are no compares, so the loops below compile to plain SIMD
+	 * multiplies and adds
+	 */
+	const double roundingConstant = 6755399441055744.0;
+	double quotient = (value*pInverse + roundingConstant) - roundingConstant;
+	return value - quotient*p;
+}
+
+static long long invMod(long long a, long long p) {
+	// The inverse of a modulo p, with the extended Euclidean algorithm
+	long long r0=p, r1=(a<0) ? a+p : a, t0=0, t1=1;
+	while (r1) {
+		long long q = r0/r1, t;
+		t=r0-q*r1; r0=r1; r1=t;
+		t=t0-q*t1; t0=t1; t1=t;
+	}
+	return (t0<0) ? t0+p : t0;
+}
+
+static long long previousPrime(long long n) {
+	while (true) {
+		n--;
+		bool prime=true;
+		for (long long d=2;d*d<=n && prime;d++) {prime = (n%d!=0);}
+		if (prime) {return n;}
+	}
+}
+
+struct ModularSolution {
+	std::vector<int> pivotCols; // Columns with a pivot. All of them, unless the matrix is singular modulo the prime
+	std::vector<int> pivotRows; // The row swapped in for every pivot
+	std::vector<double> values; // The solution, or if singular a vector in the kernel of A. In the symmetric range
+};
+
+static void solveModular(const std::vector<int>& A, const std::vector<long long>& b, int n, long long prime,
+		std::vector<double>& M, ModularSolution& solution, WorkerPool* pool) {
+	/* Gaussian elimination of [A|b] modulo prime, with M as the work matrix, and the rows below the pivot split
+	 * between the workers of pool if it isn't NULL. The pivot is the first non zero value in the column, so the pivot
+	 * columns are the first columns of A that are linearly independent. For all but a few primes they are the same as
+	 * for the rational matrix, which makes the kernel vector below unique. If A has full rank, M is left with its LU
+	 * factorization for solveFactorized: the multipliers of L below the diagonal, the inverses of the pivots on it,
+	 * and U (with ones on the diagonal) above it
+	 */
+	double p = prime, pInverse = 1.0/p;
+	int width = n+1, rank=0;
+	M.resize((size_t)n*width);
+	for (int i=0;i<n;i++) {
+		for (int j=0;j<n;j++) {M[(size_t)i*width+j] = reduceMod(A[(size_t)i*n+j] % prime,p,pInverse);}
+		M[(size_t)i*width+n] = reduceMod(b[i] % prime,p,pInverse);
+	}
+
+	solution.pivotCols.clear();
+	solution.pivotRows.clear();
+	for (int col=0;col<n && rank<n;col++) {
+		int pivotRow=rank;
+		while (pivotRow<n && M[(size_t)pivotRow*width+col]==0) {pivotRow++;}
+		if (pivotRow==n) {continue;} // A free column
+
+		double* pivot = &M[(size_t)rank*width];
+		if (pivotRow!=rank) {std::swap_ranges(pivot,pivot+width,&M[(size_t)pivotRow*width]);} // With the multipliers left of col
+		double inverse = reduceMod(invMod((long long)pivot[col],prime),p,pInverse);
+		for (int j=col+1;j<width;j++) {pivot[j] = reduceMod(pivot[j]*inverse,p,pInverse);}
+		pivot[col] = inverse;
+
+		auto eliminate = [&](int firstRow, int endRow) {
+			// The product is below 2^50 and the row value below 2^25, so one reduction is enough
+			for (int i=firstRow;i<endRow;i++) {
+				double* row = &M[(size_t)i*width];
+				double factor = row[col];
+				if (factor==0) {continue;}
+				for (int j=col+1;j<width;j++) {row[j] = reduceMod(row[j] - factor*pivot[j],p,pInverse);}
+			}
+		};
+		int nrRows = n-rank-1;
+		if (pool && nrRows > PARALLEL_MIN_ROWS) {
+			pool->run([&](int w) {eliminate(rank+1+pool->blockStart(w,nrRows),rank+1+pool->blockEnd(w,nrRows));});
+		}
+		else {eliminate(rank+1,n);}
+		solution.pivotCols.push_back(col);
+		solution.pivotRows.push_back(pivotRow);
+		rank++;
+	}
+
+	/* Back substitution. If the matrix is singular, the kernel vector has a 1 in the first free column and 0 in the
+	 * other free columns
+	 */
+	solution.values.assign(n,0);
+	if (rank<n) {
+		int freeCol=0;
+		while (freeCol<rank && solution.pivotCols[freeCol]==freeCol) {freeCol++;}
+		solution.values[freeCol]=1;
+	}
+	for (int k=rank-1;k>=0;k--) {
+		const double* row = &M[(size_t)k*width];
+		int col = solution.pivotCols[k];
+		double sum = (rank==n) ? row[n] : 0;
+		for (int j=col+1;j<n;j++) {
+			if (solution.values[j]==0) {continue;}
+			sum = reduceMod(sum - reduceMod(row[j]*solution.values[j],p,pInverse),p,pInverse);
+		}
+		solution.values[col]=sum;
+	}
+}
+
+static void solveFactorized(const std::vector<double>& M, int n, const ModularSolution& factorization, long long prime, std::vector<double>& r) {
+	/* r = A^-1 r modulo prime, with the LU factorization solveModular left in M. The products are reduced one at a
+	 * time, and their sum only at the end, which is exact as long as n is below 2^27
+	 */
+	double p = prime, pInverse = 1.0/p;
+	int width = n+1;
+	for (int k=0;k<n;k++) {std::swap(r[k],r[factorization.pivotRows[k]]);}
+	for (int k=0;k<n;k++) {
+		const double* row = &M[(size_t)k*width];
+		double sum = r[k];
+		for (int j=0;j<k;j++) {sum -= reduceMod(row[j]*r[j],p,pInverse);}
+		r[k] = reduceMod(reduceMod(sum,p,pInverse)*row[k],p,pInverse);
+	}
+	for (int k=n-1;k>=0;k--) {
+		const double* row = &M[(size_t)k*width];
+		double sum = r[k];
+		for (int j=k+1;j<n;j++) {sum -= reduceMod(row[j]*r[j],p,pInverse);}
+		r[k] = reduceMod(sum,p,pInverse);
+	}
+}
+
+static BigInt symmetricMod(const BigInt& a, const BigInt& modulus) {
+	// a mod modulus, in (-modulus/2,modulus/2]
+	BigInt r = BigInt::mod(a,modulus);
+	if (BigInt::compareMagnitude(r+r,modulus)>0) {r = r-modulus;}
+	return r;
+}
+
+static bool rationalReconstruct(const BigInt& y, const BigInt& modulus, int boundBits, BigInt& numerator, BigInt& denominator) {
+	// Finds numerator/denominator = y modulo modulus, with both below 2^boundBits, with the extended Euclidean algorithm
+	BigInt r0 = modulus, r1 = BigInt::mod(y,modulus), t0 = 0, t1 = 1, q, r;
+	while (r1.bitLength()>boundBits) {
+		BigInt::divMod(r0,r1,q,r);
+		r0=r1;
+		r1=r;
+		BigInt t = t0-q*t1;
+		t0=t1;
+		t1=t;
+	}
+	if (t1.isZero() || t1.bitLength()>boundBits) {return false;}
+	numerator = t1.isNegative() ? -r1 : r1;
+	denominator = t1.abs();
+	return true;
+}
+
+static bool reconstructSolution(const std::vector<BigInt>& residues, const BigInt& modulus, std::vector<BigInt>& numerators, BigInt& denominator) {
+	/* Finds the rational vector numerators/denominator that is congruent to residues. The common denominator grows
+	 * as components need it, so most components only need a multiplication instead of a rational reconstruction
+	 */
+	int boundBits = (modulus.bitLength()-2)/2;
+	BigInt numerator,componentDenominator;
+	denominator=1;
+
+	for (size_t i=0;i<residues.size();i++) {
+		BigInt y = symmetricMod(denominator*residues[i],modulus);
+		if (y.bitLength()<=boundBits) {continue;}
+		if (!rationalReconstruct(y,modulus,boundBits,numerator,componentDenominator)) {return false;}
+		denominator = denominator*componentDenominator;
+		if (denominator.bitLength()>boundBits) {return false;}
+	}
+	numerators.resize(residues.size());
+	for (size_t i=0;i<residues.size();i++) {
+		numerators[i] = symmetricMod(denominator*residues[i],modulus);
+		if (numerators[i].bitLength()>boundBits) {return false;}
+	}
+	return true;
+}
+
+static int solveExact(const char* eqFileName, int nrThreads) {
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable;
+	std::vector<ParsedEquation> equations;
+
+	bool readOk = readEquationsPipelined(eqFileName,[&](ParsedEquation& equation) {
+		equations.push_back(std::move(equation));
+	},variableList,rowOfVariable);
+	if (!readOk) {return -1;}
+	int matSize=equations.size();
+	if (matSize==0) {std::cerr << "No equations in input file" << std::endl;return-1;}
+
+	// The integer matrix, and the log2 of the Hadamard bound of [A|b], which bounds the size of the solution
+	std::vector<int> A((size_t)matSize*matSize,0);
+	std::vector<long long> b(matSize);
+	double hadamardBits=0;
+	for (int i=0;i<matSize;i++) {
+		int* row = &A[(size_t)i*matSize];
+		row[i]=1;
+		for (size_t t=0;t<equations[i].terms.size();t++) {
+			int col = rowOfVariable[equations[i].terms[t]];
+			equations[i].terms[t]=col;
+			row[col]--;
+		}
+		b[i]=equations[i].constant;
+		double rowNorm = (double)b[i]*b[i];
+		for (int j=0;j<matSize;j++) {rowNorm += (double)row[j]*row[j];}
+		hadamardBits += 0.5*log2(std::max(rowNorm,1.0)); // Zero rows only make minors zero
+	}
+
+	WorkerPool pool(nrThreads);
+	std::vector<long long> primes(nrThreads);
+	std::vector<ModularSolution> solutions(nrThreads);
+	std::vector<std::vector<double>> work(nrThreads);
+	std::vector<int> pivotCols;
+	std::vector<BigInt> residues,numerators;
+	BigInt modulus,denominator;
+	int nrPrimes=0,nextAttempt=1;
+
+	auto verify = [&](bool singular) {
+		// Checks A*numerators = denominator*b exactly, or A*numerators = 0 for a kernel vector
+		std::vector<char> rowOk(matSize);
+		pool.run([&](int w) {
+			for (int i=pool.blockStart(w,matSize);i<pool.blockEnd(w,matSize);i++) {
+				BigInt sum = numerators[i];
+				for (size_t t=0;t<equations[i].terms.size();t++) {sum = sum-numerators[equations[i].terms[t]];}
+				rowOk[i] = (sum == (singular ? BigInt() : denominator*BigInt(b[i])));
+			}
+		});
+		return std::find(rowOk.begin(),rowOk.end(),0)==rowOk.end();
+	};
+
+	// Factorize modulo one prime on all the workers
+	long long prime = previousPrime(1LL<<EXACT_PRIME_BITS);
+	primes[0] = prime;
+	solveModular(A,b,matSize,prime,work[0],solutions[0],&pool);
+	int nrSolutions=1,factorized=-1;
+
+	while (true) {
+		for (int w=0;w<nrSolutions && factorized==-1;w++) {
+			if ((int)solutions[w].pivotCols.size()==matSize) {factorized=w;}
+		}
+		if (factorized!=-1) {break;}
+
+		for (int w=0;w<nrSolutions;w++) {
+			/* A prime that gives a lower rank or later pivot columns than the others divides some minor of A, its
+			 * result is not the reduction of the rational one and is dropped. If it is the first good prime, the
+			 * primes so far were the bad ones
+			 */
+			const ModularSolution& solution = solutions[w];
+			bool better = (nrPrimes==0) || solution.pivotCols.size()>pivotCols.size() ||
+					(solution.pivotCols.size()==pivotCols.size() && solution.pivotCols<pivotCols);
+			if (better) {
+				pivotCols = solution.pivotCols;
+				residues.assign(matSize,BigInt());
+				modulus=1;
+				nrPrimes=0;
+				nextAttempt=1;
+			}
+			else if (solution.pivotCols!=pivotCols) {continue;}
+
+			// Chinese remaindering, residue += modulus * ((value-residue)/modulus mod p), done by the workers in blocks
+			long long p = primes[w], modulusInverse = invMod(modulus.modSmall(p),p);
+			pool.run([&](int v) {
+				for (int i=pool.blockStart(v,matSize);i<pool.blockEnd(v,matSize);i++) {
+					long long difference = ((long long)solution.values[i] - residues[i].modSmall(p) + 2*p) % p;
+					residues[i] = residues[i] + modulus*BigInt(difference*modulusInverse % p);
 				}
+			});
+			modulus = modulus*BigInt(p);
+			nrPrimes++;
+		}
+
+		if (nrPrimes>=nextAttempt) {
+			if (reconstructSolution(residues,modulus,numerators,denominator) && verify(true)) {
+				std::cout << "Matrix is singular" << std::endl;
+				return -1;
 			}
-			firstToken=true;
-			lineIndex++;
+			nextAttempt = nrPrimes + std::max(1,nrPrimes/4); // So that the attempts cost about as much as the primes
 		}
+		if (modulus.bitLength() > 2*hadamardBits+64) {
+			// Past the bound the reconstruction can't fail, unless something is wrong
+			std::cerr << "Exact solution could not be verified" << std::endl;
+			return -1;
+		}
+
+		// Solve modulo the next prime on every thread
+		for (int w=0;w<nrThreads;w++) {prime = previousPrime(prime); primes[w]=prime;}
+		if (prime<2) {std::cerr << "Out of primes" << std::endl; return -1;} // Only with a very small EXACT_PRIME_BITS
+		pool.run([&](int w) {solveModular(A,b,matSize,primes[w],work[w],solutions[w],NULL);});
+		nrSolutions=nrThreads;
 	}
-	else {
-		std::cerr << "Unable to open file" << std::endl;
-		return -1;
+
+	// Dixon lifting with the factorization modulo p. |r| stays below p/2 times the longest row, plus |b|/p^k
+	long long p = primes[factorized];
+	std::vector<long long> r(b);
+	std::vector<double> digits(matSize);
+	residues.assign(matSize,BigInt());
+	modulus=1;
+	int nrSteps=0;
+	nextAttempt=1;
+	while (true) {
+		for (int i=0;i<matSize;i++) {digits[i] = (double)(r[i]%p);}
+		solveFactorized(work[factorized],matSize,solutions[factorized],p,digits);
+		pool.run([&](int w) {
+			for (int i=pool.blockStart(w,matSize);i<pool.blockEnd(w,matSize);i++) {
+				// (A digits)_i is digits_i minus the digits of the variables of equation i, which makes r_i divisible by p
+				long long Ax = (long long)digits[i];
+				for (size_t t=0;t<equations[i].terms.size();t++) {Ax -= (long long)digits[equations[i].terms[t]];}
+				r[i] = (r[i]-Ax)/p;
+				residues[i] = residues[i] + modulus*BigInt((long long)digits[i]);
+			}
+		});
+		modulus = modulus*BigInt(p);
+		nrSteps++;
+
+		if (nrSteps>=nextAttempt) {
+			if (reconstructSolution(residues,modulus,numerators,denominator) && verify(false)) {break;}
+			nextAttempt = nrSteps + std::max(1,nrSteps/4); // So that the attempts cost about as much as the steps
+		}
+		if (modulus.bitLength() > 2*hadamardBits+64) {
+			// Past the bound the reconstruction can't fail, unless something is wrong
+			std::cerr << "Exact solution could not be verified" << std::endl;
+			return -1;
+		}
 	}
 
-	inFile.close();
+	// Print every value as a reduced fraction, or as an integer if its denominator is 1
+	std::vector<std::string> values(matSize);
+	pool.run([&](int w) {
+		for (int i=pool.blockStart(w,matSize);i<pool.blockEnd(w,matSize);i++) {
+			BigInt divisor = BigInt::gcd(numerators[i],denominator),numerator,componentDenominator,remainder;
+			BigInt::divMod(numerators[i],divisor,numerator,remainder);
+			BigInt::divMod(denominator,divisor,componentDenominator,remainder);
+			values[i] = numerator.toString();
+			if (componentDenominator!=BigInt(1)) {values[i] += "/" + componentDenominator.toString();}
+		}
+	});
+
+	std::vector<std::pair<std::string,std::string>> varPairs;
+	varPairs.reserve(matSize);
+	for (int i=0;i<matSize;i++) {
+		varPairs.push_back(std::make_pair(variableList[i],values[i]));
+	}
+
+	// Sort the strings:
+	sort( varPairs.begin(), varPairs.end());
+
+	// Print the result:
+	for (int i=0;i<matSize;i++) {
+		std::cout << varPairs[i].first << " = " << varPairs[i].second << std::endl;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc<2) {std::cerr << "No equation file provided in command line argument" << std::endl; return -1;}
+
+	long memoryMB=0;
+	const char* scratchFileName=NULL;
+	int nrThreads=1;
+	bool numaReport=false,exact=false,threadsGiven=false,blockTriangular=false,batch=false;
+	for (int i=2;i<argc;i++) {
+		std::string arg(argv[i]);
+		if (arg=="-ooc" && i+1<argc) {
+			// Out of core mode, the matrix is kept in a scratch file and at most MB of it are held in memory
+			memoryMB = atol(argv[++i]);
+			if (memoryMB<=0) {std::cerr << "Illegal memory budget" << std::endl; return -1;}
+			if (i+1<argc && argv[i+1][0]!='-') {scratchFileName=argv[++i];}
+		}
+		else if (arg=="-threads" && i+1<argc) {nrThreads=atoi(argv[++i]); threadsGiven=true;}
+		else if (arg=="-exact") {exact=true;}
+		else if (arg=="-btf") {blockTriangular=true;}
+		else if (arg=="-batch") {batch=true;}
+		else if (arg=="-numareport") {numaReport=true;}
+		else {std::cerr << "Unknown argument " << arg << std::endl; return -1;}
+	}
+	if (nrThreads<1) {std::cerr << "Number of threads must be positive" << std::endl; return -1;}
+	if (batch) {
+		if (memoryMB>0) {std::cerr << "-ooc can't be combined with -batch" << std::endl; return -1;}
+		if (exact) {std::cerr << "-exact can't be combined with -batch" << std::endl; return -1;}
+		if (blockTriangular) {std::cerr << "-btf can't be combined with -batch" << std::endl; return -1;}
+		if (numaReport) {std::cerr << "-numareport can't be combined with -batch" << std::endl; return -1;}
+		// One system per core at a time, unless -threads is given
+		if (!threadsGiven) {nrThreads = std::max(1u,std::thread::hardware_concurrency());}
+		return solveBatch(argv[1],nrThreads);
+	}
+	if (exact) {
+		// One prime per core, unless -threads is given
+		if (!threadsGiven) {nrThreads = std::max(1u,std::thread::hardware_concurrency());}
+		return solveExact(argv[1],nrThreads);
+	}
+	if (memoryMB>0) {return solveOutOfCore(argv[1],(size_t)memoryMB*1024*1024,scratchFileName);}
+
+	WorkerPool* pool = (nrThreads>1) ? new WorkerPool(nrThreads) : NULL;
+	if (blockTriangular) {
+		int result = solveBlockTriangular(argv[1],pool);
+		delete pool;
+		return result;
+	}
+
+	/* Read the input file. Reading, tokenizing and resolving the variable names run concurrently, see
+	 * EquationPipeline.h. The dense matrix can only be allocated once the number of equations is known, so the
+	 * equations are kept with their variable ids until then
+	 */
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable;
+	std::vector<ParsedEquation> equations;
+
+	bool readOk = readEquationsPipelined(argv[1],[&](ParsedEquation& equation) {
+		equations.push_back(std::move(equation));
+	},variableList,rowOfVariable);
+	if (!readOk) {return -1;}
+
+	int matSize=equations.size();
+	if (matSize==0) {std::cerr << "No equations in input file" << std::endl;return-1;}
+
+	// Allocate the matrices, zero initialized with ()
+	double** A = new double*[matSize];
+	double* b = new double[matSize]();
+	double* x = new double[matSize]();
+	double* y = new double[matSize]();
+	int* P = new int[matSize](); // Permutation vector
+
+	auto assembleRow = [&](int i) {
+		A[i] = new double[matSize]();
+		A[i][i]=1;
+		for (size_t t=0;t<equations[i].terms.size();t++) {
+			A[i][rowOfVariable[equations[i].terms[t]]]--; // Subtract 1 from the matrix 'A'
+		}
+		b[i]=equations[i].constant;
+		std::vector<int>().swap(equations[i].terms);
+	};
+	if (pool) {
+		// Every worker allocates and fills the rows it owns, so that they are placed on its NUMA node
+		pool->run([&](int w) {
+			for (int i = w; i < matSize; i+=pool->size()) {assembleRow(i);}
+		});
+	}
+	else {
+		for (int i = 0; i < matSize; ++i) {assembleRow(i);}
+	}
+	equations.clear();
 
 //	// Print the matrix and the b vector to files:
 //	std::ofstream matrixOut("matrixOut");
@@ -183,23 +964,11 @@ int main(int argc, char** argv) {
 //	}
 //	bOut.close();
 
-	if(!LUPfactorize(A,P,matSize)) {return -1;}
-
-	// Now x is given by the equations: L*y=b and U*x=y
-	for (int i=0;i<matSize;i++) {
-		y[P[i]] = b[P[i]];
-		for (int j=0;j<i;j++) {
-			y[P[i]]-=A[i][j]*y[P[j]];
-		}
-		y[P[i]]=y[P[i]]/1; // The diagonal of the lower triangular matrix is 1
-	}
-	for (int i=matSize-1;i>=0;i--) {
-		x[P[i]] = y[P[i]];
-		for (int j=i+1;j<matSize;j++) {
-			x[P[i]]-=A[i][j]*x[P[j]];
-		}
-		x[P[i]]=x[P[i]]/A[i][i];
-	}
+	bool factorized = LUPfactorize(A,P,matSize,pool);
+	if (pool && numaReport) {pool->reportBandwidth(std::cerr);}
+	delete pool;
+	if (!factorized) {std::cout << "Matrix is singular to working precision" << std::endl; return -1;}
+	LUPsolve(A,P,b,x,y,matSize);
 
 	// Associate each variable string with its value:
 	std::vector<std::pair<std::string,double>> varPairs;
@@ -9,6 +9,7 @@
 #include <unordered_map>
 #include <math.h> //fmod
 #include <iostream>
+#include <algorithm> // max
 
 /* This program tests the given solution by checking:
  * a) that the first char in the varName string isalpha,
@@ -24,6 +25,25 @@
  * d) if the variables have decimals - decimals are permitted
  */
 
+static double parseValue(const std::string& value) {
+	/* Values are decimals, or exact fractions "numerator/denominator" from TCcalc -exact. The numbers of a fraction
+	 * can be too large for a double, so only their leading digits are used, and the exponents are taken apart
+	 */
+	size_t slash = value.find('/');
+	if (slash==std::string::npos) {return std::stod(value);}
+
+	std::string parts[2] = {value.substr(0,slash),value.substr(slash+1)};
+	double mantissa[2];
+	int exponent[2];
+	for (int i=0;i<2;i++) {
+		bool negative = (parts[i][0]=='-');
+		std::string digits = parts[i].substr(negative ? 1 : 0);
+		exponent[i] = std::max(0,(int)digits.size()-17);
+		mantissa[i] = std::stod(digits.substr(0,digits.size()-exponent[i])) * (negative ? -1 : 1);
+	}
+	return mantissa[0]/mantissa[1] * pow(10,exponent[0]-exponent[1]);
+}
+
 int main(int argc, char** argv) {
 	if (argc<2) {std::cerr << "No equation file provided in command line argument" << std::endl; return -1;}
 
@@ -31,18 +51,18 @@ int main(int argc, char** argv) {
 	std::stringstream ss;
 	std::string line, varName, token;
 	int nrEquations=0;
-	double varValue;
+	std::string varValue;
 	char eqsign;
 
 	// Read infile
 	while (getline(std::cin,line)) {
-		if (line=="Matrix is singular to working precision") {return 0;} // If equation system doesn't have a solution, return
+		if (line=="Matrix is singular to working precision" || line=="Matrix is singular") {return 0;} // If equation system doesn't have a solution, return
 
 		ss.str(line);
 		ss.clear();
 		ss >> varName >> eqsign >> varValue;
 		if (!isalpha(varName[0]) /*|| fmod(varValue,1)!=0*/) {return -1;}
-		variableMap.insert({varName,varValue});
+		variableMap.insert({varName,parseValue(varValue)});
 		nrEquations++;
 	}
 
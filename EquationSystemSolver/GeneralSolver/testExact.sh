@@ -0,0 +1,6 @@
+#! /bin/sh -
+i=0; while [ "$i" -lt 100 ]; do
+  ./TCgen eq
+  ./TCcalc eq -exact | ./TCcheck eq || break
+  i=$((i + 1))
+done
@@ -0,0 +1,378 @@
+//============================================================================
+// Name        : Multigrid.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef MULTIGRID_H
+#define MULTIGRID_H
+
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include "NumaPlacement.h"
+#include "CompressedRows.h"
+#include "DenseLU.h"
+
+/* Algebraic multigrid for the iterative solver. The Jacobi and Gauss-Seidel methods only move information one
+ * reference per iteration, so a system where the variables refer to each other in long chains needs as many iterations
+ * as the chains are long. Multigrid solves the system on a hierarchy of smaller and smaller systems instead. A level is
+ * made from the one above it by aggregation: every variable is put in an aggregate with its neighbours (the variables
+ * it refers to or that refer to it), and each aggregate becomes one variable of the next level, with the matrix
+ * P^T A P (A = I - C, and P is 1 where a variable is in an aggregate). Only strong couplings count (AMG_STRENGTH), and
+ * variables without strong neighbours are left out, the smoother solves them on its own. The coarsest level is solved
+ * with the LU factorization of TCcalc (DenseLU.h).
+ *
+ * One cycle (a V-cycle) smooths the error on a level with AMG_SMOOTHING_STEPS damped Jacobi sweeps (Gauss-Seidel with
+ * -DUSE_GSEIDEL), moves the rest of the residual down to the next level, solves it there with a cycle, adds that correction back and smooths
+ * again. On the finest level the sweep is the one of the Jacobi solver (CompressedRows.h). The cycle can be used as a
+ * solver on its own, or as the preconditioner of BiCGSTAB.
+ *
+ * In the setup the coarse rows (P^T A P) and the LU factorization of the coarsest level are split between the workers
+ * of the pool. The aggregation is one pass over all rows: aggregates that stop at the edges of the blocks of the
+ * workers coarsen badly when the variables refer to each other across the whole system, and it costs little next to
+ * the coarse rows
+ */
+
+#ifndef AMG_COARSE_ROWS
+#define AMG_COARSE_ROWS 1000 // Coarsening stops at this many rows, and the coarsest level is factorized if it has no more
+#endif
+
+#ifndef AMG_MAX_LEVELS
+#define AMG_MAX_LEVELS 25
+#endif
+
+#ifndef AMG_MIN_COARSENING
+#define AMG_MIN_COARSENING 0.85 // Coarsening stops when the next level would have more than this share of the rows
+#endif
+
+#ifndef AMG_STRENGTH
+#define AMG_STRENGTH 0.5 // A row is only aggregated with the variables that carry at least this share of its coupling
+#endif
+
+#ifndef AMG_SMOOTHING_WEIGHT
+#define AMG_SMOOTHING_WEIGHT 0.7 // Of the Jacobi smoother
+#endif
+
+#ifndef AMG_SMOOTHING_STEPS
+#define AMG_SMOOTHING_STEPS 2 // Before and after the correction from the next level
+#endif
+
+#ifndef AMG_COARSE_SWEEPS
+#define AMG_COARSE_SWEEPS 10 // Smoothing steps on the coarsest level, if it is too large (or singular) to factorize
+#endif
+
+struct AmgLevel {
+	// The matrix of a level, with the diagonal kept apart, and the vectors of a cycle
+	std::vector<int> rowStart,cols;
+	std::vector<double> values,diagonal;
+	std::vector<int> aggregateOf; // The row of the next level a row goes to, -1 if it is left out
+	std::vector<double> r,e,t;
+
+	AmgLevel() : rowStart(1,0) {}
+	int nrRows() const {return rowStart.size()-1;}
+	long long nrNonZeros() const {return (long long)cols.size()+nrRows();}
+};
+
+class Multigrid {
+public:
+	Multigrid() : fine(NULL), finestNonZeros(0), coarseFactorized(false) {}
+
+	void setup(const std::vector<int>& rowStart, const std::vector<int>& cols, const std::vector<int>& coefs, const CompressedRows& compressed, WorkerPool* pool) {
+		/* Builds the hierarchy for A = I - C, where C is given both as compressed rows (rowStart, cols and coefs, with
+		 * the columns resolved) and encoded, for the sweeps of the finest level
+		 */
+		fine = &compressed;
+		levels.assign(1,AmgLevel());
+		AmgLevel& top = levels[0];
+		top.rowStart = rowStart;
+		top.cols = cols;
+		top.values.resize(coefs.size());
+		for (size_t k=0;k<coefs.size();k++) {top.values[k] = -coefs[k];}
+		top.diagonal.assign(top.nrRows(),1.0);
+
+		while (levels.back().nrRows() > AMG_COARSE_ROWS && (int)levels.size() < AMG_MAX_LEVELS) {
+			int nrAggregates = aggregate(levels.back());
+			if (nrAggregates==0 || nrAggregates > AMG_MIN_COARSENING*levels.back().nrRows()) {break;}
+			levels.push_back(AmgLevel());
+			coarsen(levels[levels.size()-2],levels.back(),nrAggregates,pool);
+		}
+		// A singular coarsest level would spoil the cycles, then the levels above it are used without it
+		for (;;) {
+			levels.back().aggregateOf.clear();
+			factorizeCoarsest(pool);
+			if (coarseFactorized || levels.size()==1 || levels.back().nrRows() > AMG_COARSE_ROWS) {break;}
+			levels.pop_back();
+		}
+
+		for (size_t l=0;l<levels.size();l++) {
+			levels[l].r.assign(levels[l].nrRows(),0);
+			levels[l].e.assign(levels[l].nrRows(),0);
+			levels[l].t.assign(levels[l].nrRows(),0);
+		}
+		zero.assign(nrRows(),0);
+		// The finest matrix is only needed for the setup, the cycles use the encoded one
+		finestNonZeros = levels[0].nrNonZeros();
+		std::vector<int>().swap(levels[0].cols);
+		std::vector<double>().swap(levels[0].values);
+	}
+
+	int nrRows() const {return levels[0].nrRows();}
+	int nrLevels() const {return levels.size();}
+
+	void multiply(const double* v, double* Av) {
+		// Av = (I - C) v, on the finest level
+		fine->sweep(zero.data(),v,Av,0);
+		for (int i=0;i<nrRows();i++) {Av[i] = v[i]-Av[i];}
+	}
+
+	void cycle(const double* r, double* e) {
+		// e = an approximate solution of A e = r, one V-cycle from e = 0
+		std::copy(r,r+nrRows(),levels[0].r.begin());
+		cycleLevel(0);
+		std::copy(levels[0].e.begin(),levels[0].e.end(),e);
+	}
+
+	std::string description() const {
+		std::ostringstream ss;
+		long long total=0;
+		for (size_t l=0;l<levels.size();l++) {
+			long long nonZeros = (l==0) ? finestNonZeros : levels[l].nrNonZeros();
+			total += nonZeros;
+			ss << "Level " << l << ": " << levels[l].nrRows() << " rows, " << nonZeros << " nonzeros\n";
+		}
+		ss << "Operator complexity " << (double)total/finestNonZeros << ", coarsest level " << (coarseFactorized ? "factorized" : "smoothed");
+		return ss.str();
+	}
+
+private:
+	static void forEachBlock(WorkerPool* pool, int nrRows, const std::function<void(int,int,int)>& job) {
+		// job(w,firstRow,endRow) for every worker of the pool, or for all rows at once without a pool
+		if (!pool) {job(0,0,nrRows); return;}
+		pool->run([&](int w) {job(w,pool->blockStart(w,nrRows),pool->blockEnd(w,nrRows));});
+	}
+
+	static int aggregate(AmgLevel& level) {
+		// Fills in level.aggregateOf and returns the number of aggregates
+		int nrRows = level.nrRows();
+		level.aggregateOf.assign(nrRows,-1);
+
+		// The strong neighbours, in both directions
+		std::vector<double> coupling(nrRows,0.0);
+		for (int i=0;i<nrRows;i++) {
+			for (int k=level.rowStart[i];k<level.rowStart[i+1];k++) {coupling[i] += std::max(0.0,-level.values[k]);}
+		}
+		auto strong = [&](int i, int k) {
+			return level.cols[k]!=i && -level.values[k] > 0 && -level.values[k] >= AMG_STRENGTH*coupling[i];
+		};
+		std::vector<int> start(nrRows+1,0),neighbours;
+		for (int i=0;i<nrRows;i++) {
+			for (int k=level.rowStart[i];k<level.rowStart[i+1];k++) {
+				if (strong(i,k)) {start[i+1]++; start[level.cols[k]+1]++;}
+			}
+		}
+		for (int i=0;i<nrRows;i++) {start[i+1]+=start[i];}
+		neighbours.resize(start[nrRows]);
+		std::vector<int> next(start.begin(),start.end()-1);
+		for (int i=0;i<nrRows;i++) {
+			for (int k=level.rowStart[i];k<level.rowStart[i+1];k++) {
+				if (strong(i,k)) {neighbours[next[i]++]=level.cols[k]; neighbours[next[level.cols[k]]++]=i;}
+			}
+		}
+
+		/* Greedy aggregation: a variable whose neighbours are all free starts an aggregate with them, then the
+		 * variables left join the aggregate of a neighbour. Variables without strong neighbours are left out
+		 */
+		int* aggregateOf = level.aggregateOf.data();
+		int nrAggregates=0;
+		for (int i=0;i<nrRows;i++) {
+			if (aggregateOf[i]!=-1 || start[i]==start[i+1]) {continue;}
+			bool free=true;
+			for (int k=start[i];k<start[i+1] && free;k++) {free = (aggregateOf[neighbours[k]]==-1);}
+			if (!free) {continue;}
+			aggregateOf[i]=nrAggregates;
+			for (int k=start[i];k<start[i+1];k++) {aggregateOf[neighbours[k]]=nrAggregates;}
+			nrAggregates++;
+		}
+		for (int i=0;i<nrRows;i++) {
+			if (aggregateOf[i]!=-1) {continue;}
+			for (int k=start[i];k<start[i+1];k++) {
+				if (aggregateOf[neighbours[k]]!=-1) {aggregateOf[i]=aggregateOf[neighbours[k]]; break;}
+			}
+		}
+		return nrAggregates;
+	}
+
+	static void coarsen(const AmgLevel& level, AmgLevel& coarse, int nrAggregates, WorkerPool* pool) {
+		/* coarse = P^T A P. The aggregates are split between the workers, every worker computes the rows of its own
+		 * aggregates, and they are put together in order of the workers
+		 */
+		int nrRows = level.nrRows(), nrBlocks = pool ? pool->size() : 1;
+		std::vector<int> memberStart(nrAggregates+1,0),members;
+		for (int i=0;i<nrRows;i++) {
+			if (level.aggregateOf[i]!=-1) {memberStart[level.aggregateOf[i]+1]++;}
+		}
+		for (int a=0;a<nrAggregates;a++) {memberStart[a+1]+=memberStart[a];}
+		members.resize(memberStart[nrAggregates]);
+		std::vector<int> next(memberStart.begin(),memberStart.end()-1);
+		for (int i=0;i<nrRows;i++) {
+			if (level.aggregateOf[i]!=-1) {members[next[level.aggregateOf[i]]++]=i;}
+		}
+
+		std::vector<AmgLevel> parts(nrBlocks);
+		std::vector<int> firstAggregate(nrBlocks,0);
+		forEachBlock(pool,nrAggregates,[&](int w, int first, int end) {
+			// Each aggregate's row is summed from the rows of its members with a scatter array
+			AmgLevel& part = parts[w];
+			firstAggregate[w]=first;
+			std::vector<int> position(nrAggregates,-1);
+			for (int a=first;a<end;a++) {
+				double diagonal=0;
+				size_t rowBegin=part.cols.size();
+				for (int m=memberStart[a];m<memberStart[a+1];m++) {
+					int i=members[m];
+					diagonal += level.diagonal[i];
+					for (int k=level.rowStart[i];k<level.rowStart[i+1];k++) {
+						int col = level.aggregateOf[level.cols[k]];
+						if (col==-1) {continue;}
+						if (col==a) {diagonal += level.values[k]; continue;}
+						if (position[col]==-1) {
+							position[col]=part.cols.size();
+							part.cols.push_back(col);
+							part.values.push_back(0);
+						}
+						part.values[position[col]] += level.values[k];
+					}
+				}
+				for (size_t k=rowBegin;k<part.cols.size();k++) {position[part.cols[k]]=-1;}
+				part.rowStart.push_back(part.cols.size());
+				part.diagonal.push_back(diagonal);
+			}
+		});
+
+		coarse.rowStart.assign(nrAggregates+1,0);
+		coarse.diagonal.resize(nrAggregates);
+		std::vector<int> nonZeroOffset(nrBlocks+1,0);
+		for (int w=0;w<nrBlocks;w++) {nonZeroOffset[w+1]=nonZeroOffset[w]+parts[w].cols.size();}
+		coarse.cols.resize(nonZeroOffset[nrBlocks]);
+		coarse.values.resize(nonZeroOffset[nrBlocks]);
+		forEachBlock(pool,nrAggregates,[&](int w, int, int) {
+			const AmgLevel& part = parts[w];
+			for (int a=0;a<part.nrRows();a++) {
+				coarse.rowStart[firstAggregate[w]+a+1] = nonZeroOffset[w]+part.rowStart[a+1];
+				coarse.diagonal[firstAggregate[w]+a] = part.diagonal[a];
+			}
+			std::copy(part.cols.begin(),part.cols.end(),coarse.cols.begin()+nonZeroOffset[w]);
+			std::copy(part.values.begin(),part.values.end(),coarse.values.begin()+nonZeroOffset[w]);
+		});
+	}
+
+	void factorizeCoarsest(WorkerPool* pool) {
+		const AmgLevel& coarsest = levels.back();
+		int n = coarsest.nrRows();
+		coarseFactorized=false;
+		if (n > AMG_COARSE_ROWS) {return;}
+
+		coarseMatrix.assign(n,std::vector<double>(n,0.0));
+		coarseRows.resize(n);
+		coarsePermutation.resize(n);
+		coarseX.resize(n);
+		coarseY.resize(n);
+		for (int i=0;i<n;i++) {
+			coarseRows[i] = coarseMatrix[i].data();
+			coarseMatrix[i][i] = coarsest.diagonal[i];
+			for (int k=coarsest.rowStart[i];k<coarsest.rowStart[i+1];k++) {coarseMatrix[i][coarsest.cols[k]] += coarsest.values[k];}
+		}
+		coarseFactorized = (n > 0 && LUPfactorize(coarseRows.data(),coarsePermutation.data(),n,pool));
+	}
+
+	void smooth(int l) {
+		// One Jacobi (or Gauss-Seidel) step on A e = r of level l
+		AmgLevel& level = levels[l];
+		int n = level.nrRows();
+		if (l==0) {
+			// A = I - C, so the sweep t = r + C e is the Jacobi step of the Jacobi solver
+#ifdef USE_GSEIDEL
+			fine->sweep(level.r.data(),level.e.data(),level.e.data(),0);
+#else
+			fine->sweep(level.r.data(),level.e.data(),level.t.data(),0);
+			for (int i=0;i<n;i++) {level.e[i] += AMG_SMOOTHING_WEIGHT*(level.t[i]-level.e[i]);}
+#endif
+			return;
+		}
+		for (int i=0;i<n;i++) {
+			if (isZero(level.diagonal[i])) {level.t[i]=level.e[i]; continue;} // Left for the coarser levels
+			double sum=level.r[i];
+			for (int k=level.rowStart[i];k<level.rowStart[i+1];k++) {sum -= level.values[k]*level.e[level.cols[k]];}
+#ifdef USE_GSEIDEL
+			level.e[i] = sum/level.diagonal[i];
+#else
+			level.t[i] = level.e[i] + AMG_SMOOTHING_WEIGHT*(sum/level.diagonal[i]-level.e[i]);
+#endif
+		}
+#ifndef USE_GSEIDEL
+		level.e.swap(level.t);
+#endif
+	}
+
+	void residual(int l) {
+		// t = r - A e of level l
+		AmgLevel& level = levels[l];
+		int n = level.nrRows();
+		if (l==0) {
+			fine->sweep(level.r.data(),level.e.data(),level.t.data(),0);
+			for (int i=0;i<n;i++) {level.t[i] -= level.e[i];}
+			return;
+		}
+		for (int i=0;i<n;i++) {
+			double sum = level.r[i] - level.diagonal[i]*level.e[i];
+			for (int k=level.rowStart[i];k<level.rowStart[i+1];k++) {sum -= level.values[k]*level.e[level.cols[k]];}
+			level.t[i] = sum;
+		}
+	}
+
+	void cycleLevel(int l) {
+		AmgLevel& level = levels[l];
+		int n = level.nrRows();
+		std::fill(level.e.begin(),level.e.end(),0.0);
+
+		if (l==(int)levels.size()-1) {
+			if (coarseFactorized) {
+				// LUPsolve puts the value of variable i in coarseX[P[i]]
+				LUPsolve(coarseRows.data(),coarsePermutation.data(),level.r.data(),coarseX.data(),coarseY.data(),n);
+				for (int i=0;i<n;i++) {level.e[i] = coarseX[coarsePermutation[i]];}
+			}
+			else {
+				for (int s=0;s<AMG_COARSE_SWEEPS;s++) {smooth(l);}
+			}
+			return;
+		}
+
+		for (int s=0;s<AMG_SMOOTHING_STEPS;s++) {smooth(l);}
+		residual(l);
+		AmgLevel& coarse = levels[l+1];
+		std::fill(coarse.r.begin(),coarse.r.end(),0.0);
+		for (int i=0;i<n;i++) {
+			if (level.aggregateOf[i]!=-1) {coarse.r[level.aggregateOf[i]] += level.t[i];}
+		}
+		cycleLevel(l+1);
+		for (int i=0;i<n;i++) {
+			if (level.aggregateOf[i]!=-1) {level.e[i] += coarse.e[level.aggregateOf[i]];}
+		}
+		for (int s=0;s<AMG_SMOOTHING_STEPS;s++) {smooth(l);}
+	}
+
+	const CompressedRows* fine;
+	std::vector<AmgLevel> levels;
+	std::vector<double> zero;
+	long long finestNonZeros;
+	bool coarseFactorized;
+	std::vector<std::vector<double>> coarseMatrix; // The LU factorization of the coarsest level
+	std::vector<double*> coarseRows;
+	std::vector<int> coarsePermutation;
+	std::vector<double> coarseX,coarseY;
+};
+
+#endif
@@ -0,0 +1,185 @@
+//============================================================================
+// Name        : NumaPlacement.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef NUMAPLACEMENT_H
+#define NUMAPLACEMENT_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <pthread.h>
+#include <sched.h>
+
+/* Worker threads for the multicore solver paths. The workers are spread over the NUMA nodes of the machine and
+ * pinned to one CPU each. Data that a worker owns (the matrix rows it sweeps) should be allocated and zero
+ * initialized by the worker itself, from inside WorkerPool::run, so that the first touch places the pages on the
+ * worker's node. The node layout is read from /sys/devices/system/node, so no libnuma is needed. If it can't be
+ * read, all CPUs are assumed to be on one node
+ */
+
+static std::vector<int> parseCpuList(const std::string& cpuList) {
+	// Parses the kernel's cpulist format, "0-3,8-11"
+	std::vector<int> cpus;
+	std::istringstream ss(cpuList);
+	std::string range;
+
+	while (getline(ss,range,',')) {
+		if (range.empty()) {continue;}
+		size_t dash = range.find('-');
+		int first = std::stoi(range), last = (dash==std::string::npos) ? first : std::stoi(range.substr(dash+1));
+		for (int cpu=first;cpu<=last;cpu++) {cpus.push_back(cpu);}
+	}
+	return cpus;
+}
+
+static std::vector<std::vector<int>> readNumaNodes() {
+	// Returns the CPUs of every NUMA node
+	std::vector<std::vector<int>> nodes;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0,sizeof(allowed),&allowed); // Only use the CPUs the process may run on
+
+	for (int node=0;;node++) {
+		std::ifstream cpuListFile("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		std::string cpuList;
+		if (!cpuListFile.is_open()) {break;}
+		getline(cpuListFile,cpuList);
+
+		std::vector<int> cpus;
+		for (int cpu : parseCpuList(cpuList)) {
+			if (CPU_ISSET(cpu,&allowed)) {cpus.push_back(cpu);}
+		}
+		if (!cpus.empty()) {nodes.push_back(cpus);}
+	}
+
+	if (nodes.empty()) {
+		nodes.push_back(std::vector<int>());
+		for (int cpu=0;cpu<CPU_SETSIZE;cpu++) {
+			if (CPU_ISSET(cpu,&allowed)) {nodes[0].push_back(cpu);}
+		}
+	}
+	return nodes;
+}
+
+class WorkerPool {
+public:
+	/* Starts nrWorkers pinned threads. Worker w runs on node w % nrNodes, so consecutive workers (and the consecutive
+	 * row blocks they own) alternate between the nodes, and every node gets an equal share of the workers
+	 */
+	explicit WorkerPool(int nrWorkers) : nrWorkers(nrWorkers), generation(0), nrDone(0), stop(false),
+			bytesTouched(nrWorkers,0), busySeconds(nrWorkers,0) {
+		std::vector<std::vector<int>> nodes = readNumaNodes();
+		std::vector<size_t> nextCpuInNode(nodes.size(),0);
+
+		for (int w=0;w<nrWorkers;w++) {
+			int node = w % nodes.size();
+			workerNode.push_back(node);
+			workerCpu.push_back(nodes[node][nextCpuInNode[node]++ % nodes[node].size()]);
+		}
+		nrNodes = nodes.size();
+
+		for (int w=0;w<nrWorkers;w++) {threads.push_back(std::thread(&WorkerPool::workerLoop,this,w));}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop=true;
+		}
+		startCondition.notify_all();
+		for (size_t w=0;w<threads.size();w++) {threads[w].join();}
+	}
+
+	int size() const {return nrWorkers;}
+
+	void run(const std::function<void(int)>& job) {
+		// Runs job(worker) on every worker and waits until all of them are done
+		std::unique_lock<std::mutex> lock(mutex);
+		currentJob = job;
+		nrDone=0;
+		generation++;
+		startCondition.notify_all();
+		doneCondition.wait(lock,[this]{return nrDone==nrWorkers;});
+	}
+
+	// First and last+1 of the rows worker w owns, when nrRows rows are split in contiguous blocks
+	int blockStart(int w, int nrRows) const {return (int)((long long)nrRows*w/nrWorkers);}
+	int blockEnd(int w, int nrRows) const {return blockStart(w+1,nrRows);}
+
+	void addBytesTouched(int w, long long bytes) {bytesTouched[w]+=bytes;} // Only called by worker w
+
+	void reportBandwidth(std::ostream& out) const {
+		// Prints the memory bandwidth that the workers of every node achieved while running jobs
+		for (int node=0;node<nrNodes;node++) {
+			long long bytes=0;
+			double seconds=0;
+			int workersOnNode=0;
+			for (int w=0;w<nrWorkers;w++) {
+				if (workerNode[w]!=node) {continue;}
+				bytes+=bytesTouched[w];
+				seconds+=busySeconds[w];
+				workersOnNode++;
+			}
+			if (workersOnNode==0) {continue;}
+			// Per worker bandwidth, summed over the workers of the node
+			double bandwidth = (seconds>0) ? bytes / (seconds/workersOnNode) / 1e9 : 0;
+			out << "NUMA node " << node << ": " << workersOnNode << " threads, " << bytes/1e9 << " GB swept, "
+					<< bandwidth << " GB/s" << std::endl;
+		}
+	}
+
+private:
+	void workerLoop(int w) {
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(workerCpu[w],&cpuSet);
+		pthread_setaffinity_np(pthread_self(),sizeof(cpuSet),&cpuSet); // If pinning fails the worker just runs unpinned
+
+		long long seenGeneration=0;
+		while (true) {
+			std::function<void(int)> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				startCondition.wait(lock,[&]{return stop || generation!=seenGeneration;});
+				if (stop) {return;}
+				seenGeneration=generation;
+				job=currentJob;
+			}
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			job(w);
+			busySeconds[w] += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				nrDone++;
+			}
+			doneCondition.notify_one();
+		}
+	}
+
+	int nrWorkers,nrNodes;
+	std::vector<int> workerNode,workerCpu;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable startCondition,doneCondition;
+	std::function<void(int)> currentJob;
+	long long generation;
+	int nrDone;
+	bool stop;
+
+	std::vector<long long> bytesTouched;
+	std::vector<double> busySeconds;
+};
+
+#endif
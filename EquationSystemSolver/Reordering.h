@@ -0,0 +1,123 @@
+//============================================================================
+// Name        : Reordering.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef REORDERING_H
+#define REORDERING_H
+
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+
+/* Reordering of the variables for the iterative solvers. The variables are numbered in the order they are defined in
+ * the file, and the variables an equation refers to are random, so every row reads x from cache lines far apart.
+ * The reverse Cuthill-McKee ordering numbers the variables breadth first through the graph of the matrix (with an
+ * edge between i and j if either refers to the other), starting from a variable far out in the graph and visiting
+ * the neighbours with the fewest neighbours first, and then reverses the numbering. Variables that refer to each
+ * other get numbers close together, which makes the bandwidth and the profile of the matrix smaller, and the reads
+ * from x closer together
+ */
+
+#ifndef CACHE_LINE_INTS
+#define CACHE_LINE_INTS 16 // Values of x in one cache line, for the report
+#endif
+
+#ifndef CACHE_WINDOW_ROWS
+#define CACHE_WINDOW_ROWS 64 // Consecutive rows assumed to share the cache lines they read, for the report
+#endif
+
+static void reverseCuthillMcKee(int nrRows, const std::vector<int>& rowStart, const std::vector<int>& cols, std::vector<int>& order) {
+	// order[newRow] is the old row. The columns of row i are cols[rowStart[i]] to cols[rowStart[i+1]-1]
+	std::vector<int> degree(nrRows,0);
+	for (int i=0;i<nrRows;i++) {
+		for (int k=rowStart[i];k<rowStart[i+1];k++) {
+			if (cols[k]!=i) {degree[i]++; degree[cols[k]]++;}
+		}
+	}
+	std::vector<int> neighbourStart(nrRows+1,0),neighbours;
+	for (int i=0;i<nrRows;i++) {neighbourStart[i+1]=neighbourStart[i]+degree[i];}
+	neighbours.resize(neighbourStart[nrRows]);
+	std::vector<int> next(neighbourStart.begin(),neighbourStart.end()-1);
+	for (int i=0;i<nrRows;i++) {
+		for (int k=rowStart[i];k<rowStart[i+1];k++) {
+			if (cols[k]!=i) {neighbours[next[i]++]=cols[k]; neighbours[next[cols[k]]++]=i;}
+		}
+	}
+	for (int i=0;i<nrRows;i++) {
+		// Lowest degree first. An edge can be there twice, but visited variables are skipped anyway
+		std::sort(neighbours.begin()+neighbourStart[i],neighbours.begin()+neighbourStart[i+1],[&](int a, int c) {
+			return degree[a]<degree[c] || (degree[a]==degree[c] && a<c);
+		});
+	}
+
+	std::vector<int> level(nrRows,-1);
+	auto breadthFirst = [&](int root, std::vector<int>& visited) {
+		// Appends the variables of the component of root to visited, level by level. Returns the deepest level
+		size_t first=visited.size();
+		level[root]=0;
+		visited.push_back(root);
+		for (size_t v=first;v<visited.size();v++) {
+			int node=visited[v];
+			for (int k=neighbourStart[node];k<neighbourStart[node+1];k++) {
+				if (level[neighbours[k]]==-1) {level[neighbours[k]]=level[node]+1; visited.push_back(neighbours[k]);}
+			}
+		}
+		return level[visited.back()];
+	};
+
+	order.clear();
+	std::vector<int> component;
+	for (int start=0;start<nrRows;start++) {
+		if (level[start]!=-1) {continue;}
+
+		/* Find a variable far out in the component (pseudo peripheral, George and Liu): move to the variable of lowest
+		 * degree in the deepest level, as long as that makes the component deeper
+		 */
+		int root=start, depth=-1;
+		for (;;) {
+			component.clear();
+			int newDepth = breadthFirst(root,component);
+			int candidate=component.back();
+			for (size_t v=component.size();v-->0 && level[component[v]]==newDepth;) {
+				if (degree[component[v]]<degree[candidate]) {candidate=component[v];}
+			}
+			for (int node : component) {level[node]=-1;}
+			if (newDepth<=depth) {break;}
+			depth=newDepth;
+			root=candidate;
+		}
+		breadthFirst(root,order);
+	}
+	std::reverse(order.begin(),order.end());
+}
+
+static std::string describeOrdering(int nrRows, const std::vector<int>& rowStart, const std::vector<int>& cols) {
+	/* The bandwidth (the largest |i-j| of a nonzero), the profile (the sum over the rows of how far left of the
+	 * diagonal its first nonzero is) and the cache lines of x a sweep loads per row, if the lines read by
+	 * CACHE_WINDOW_ROWS consecutive rows stay in the cache between them
+	 */
+	long long bandwidth=0,profile=0,cacheLines=0;
+	std::vector<int> lines;
+	for (int i=0;i<nrRows;i++) {
+		int firstCol=i;
+		for (int k=rowStart[i];k<rowStart[i+1];k++) {
+			bandwidth = std::max(bandwidth,(long long)abs(i-cols[k]));
+			firstCol = std::min(firstCol,cols[k]);
+			lines.push_back(cols[k]/CACHE_LINE_INTS);
+		}
+		profile += i-firstCol;
+		if ((i+1)%CACHE_WINDOW_ROWS==0 || i==nrRows-1) {
+			std::sort(lines.begin(),lines.end());
+			cacheLines += std::unique(lines.begin(),lines.end())-lines.begin();
+			lines.clear();
+		}
+	}
+	std::ostringstream ss;
+	ss << "bandwidth " << bandwidth << ", profile " << profile << ", " << (nrRows ? (double)cacheLines/nrRows : 0) << " cache lines of x loaded per row";
+	return ss.str();
+}
+
+#endif
@@ -10,6 +10,18 @@
 #include <vector>
 #include <string> // std::stoi
 #include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <sys/wait.h>
+#include "NumaPlacement.h"
+#include "EquationPipeline.h"
+#include "BlockTriangular.h"
+#include "CompressedRows.h"
+#include "Reordering.h"
+#include "Multigrid.h"
+#include "BatchPool.h"
+#include "Transport.h"
 
 #ifndef MAX_ITERATIONS
 #define MAX_ITERATIONS 50
@@ -19,111 +31,614 @@
  * converges for some systems, but not all
  */
 
-static int jacobiIterate(int** C,int* b, int* x, int* xNew, int nrOfEquations) {
-	// Calculate xNew:
-	for (int i=0;i<nrOfEquations;i++) {
-		xNew[i]=b[i];
-		for (int j=0;j<nrOfEquations;j++) {
-			if (i==j) {continue;}
+struct SparseRows {
+	// The off diagonal coefficients of a block of rows, row after row (compressed rows). The diagonal is always -1
+	std::vector<int> rowStart,cols,coefs;
+
+	SparseRows() : rowStart(1,0) {}
+	int nrRows() const {return rowStart.size()-1;}
+};
+
+static void assembleRow(SparseRows& C, std::vector<int>& b, ParsedEquation& equation) {
+	// Appends the equation to the sparse matrix, with variable ids as columns
+	std::vector<int>& terms = equation.terms;
+	sort(terms.begin(),terms.end());
+	for (size_t t=0;t<terms.size();t++) {
+		// Repeated variables add up to one coefficient
+		if (t>0 && terms[t]==terms[t-1]) {C.coefs.back()++;}
+		else {C.cols.push_back(terms[t]); C.coefs.push_back(1);}
+	}
+	C.rowStart.push_back(C.cols.size());
+	b.push_back(equation.constant); // Assuming no int overflow here
+}
+
+static bool resolveColumns(SparseRows& C, const std::vector<int>& rowOfVariable, std::ostream& err) {
+	// Translates the variable ids to columns, once all rows are read
+	for (int i=0;i<C.nrRows();i++) {
+		for (int k=C.rowStart[i];k<C.rowStart[i+1];k++) {
+			C.cols[k]=rowOfVariable[C.cols[k]];
+			if (C.cols[k]==i) {
+				/* The coefficient of the diagonal variable cannot be zero. It is ok for it to be -1 or greater than 0. In the case it is not -1 or 0
+				 * then all the other coefficients and b[i] needs to be divided by that -coefficient. I assume that it never happens
+				 * here though, and only allow it to be -1
+				 */
+				err << "Error, coefficient for diagonal variable is not 1" << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void permuteRows(SparseRows& C, std::vector<int>& b, std::vector<std::string>& variableList, const std::vector<int>& order) {
+	// Row and variable order[i] becomes row and variable i. The names move with the rows, so the answers keep them
+	std::vector<int> newRow(order.size());
+	for (size_t i=0;i<order.size();i++) {newRow[order[i]]=i;}
+	SparseRows permuted;
+	std::vector<int> permutedB;
+	std::vector<std::string> permutedVariables;
+	for (size_t i=0;i<order.size();i++) {
+		int old=order[i];
+		for (int k=C.rowStart[old];k<C.rowStart[old+1];k++) {
+			permuted.cols.push_back(newRow[C.cols[k]]);
+			permuted.coefs.push_back(C.coefs[k]);
+		}
+		permuted.rowStart.push_back(permuted.cols.size());
+		permutedB.push_back(b[old]);
+		permutedVariables.push_back(variableList[old]);
+	}
+	C.rowStart.swap(permuted.rowStart);
+	C.cols.swap(permuted.cols);
+	C.coefs.swap(permuted.coefs);
+	b.swap(permutedB);
+	variableList.swap(permutedVariables);
+}
+
+static int jacobiIterate(const CompressedRows& C,int* b, int* x, int* xNew, int nrOfEquations) {
+	// Calculate xNew, the error, and set x to xNew for the next iteration
+#ifdef USE_GSEIDEL
+	(void)xNew; (void)nrOfEquations;
+	return C.sweep(b,x,x,0); // Gauss-Seidel, x is updated in place so the rows before i already have their new values
+#else
+	int error = C.sweep(b,x,xNew,0); // Jacobi
+	std::copy(xNew,xNew+nrOfEquations,x);
+	return error;
+#endif
+}
+
+static int jacobiIterateParallel(WorkerPool& pool, const std::vector<CompressedRows>& blocks,int* b, int* x, int* xNew, int nrOfEquations) {
+	/* Same as jacobiIterate, but every worker calculates the block of rows it owns (and encoded itself, so they are on
+	 * its NUMA node). x is only updated once all workers are done reading it
+	 */
+	std::vector<int> partialError(pool.size(),0);
+
+	pool.run([&](int w) {
+		partialError[w] = blocks[w].sweep(b,x,xNew,pool.blockStart(w,nrOfEquations));
+		pool.addBytesTouched(w,blocks[w].bytes());
+	});
+
+	pool.run([&](int w) {
+		std::copy(&xNew[pool.blockStart(w,nrOfEquations)],&xNew[pool.blockEnd(w,nrOfEquations)],&x[pool.blockStart(w,nrOfEquations)]);
+	});
+
+	int error=0;
+	for (int w=0;w<pool.size();w++) {error+=partialError[w];}
+	return error;
+}
+
+static bool jacobiSolveBlocks(const SparseRows& C, const std::vector<int>& b, int* x, int nrOfEquations, WorkerPool* pool) {
+	/* Block triangular mode (-btf), see BlockTriangular.h. Blocks of one row are solved by substitution, the larger
+	 * blocks are iterated on their own until they converge, with the variables of the earlier blocks already known.
+	 * The blocks of a level are divided between the threads. Returns false if a block doesn't converge
+	 */
+	BlockDecomposition blocks;
+	findBlocks(nrOfEquations,C.rowStart,C.cols,blocks);
+	std::vector<int> xNew(nrOfEquations);
+	std::atomic<bool> converged(true);
 
+	auto solveBlock = [&](int k) {
+		const int* rows = &blocks.rows[blocks.blockStart[k]];
+		int size = blocks.blockSize(k);
+		auto rowValue = [&](int row) {
+			int sum=b[row];
+			for (int c=C.rowStart[row];c<C.rowStart[row+1];c++) {sum+=(C.coefs[c] * x[C.cols[c]]);}
+			return sum;
+		};
+
+		if (size==1) {x[rows[0]] = rowValue(rows[0]); return;} // Substitution
+
+		auto iterateBlock = [&]() {
+			int error=0;
+			for (int r=0;r<size;r++) {
 #ifdef USE_GSEIDEL
-			xNew[i]+=(C[i][j] * ((j<i) ? xNew[j] : x[j])); // Gauss-Seidel
+				int value = rowValue(rows[r]); // Gauss-Seidel, x is updated in place
+				error+=abs(x[rows[r]]-value);
+				x[rows[r]]=value;
 #else
-			xNew[i]+=(C[i][j] * x[j]); // Jacobi
+				xNew[rows[r]] = rowValue(rows[r]); // Jacobi
+#endif
+			}
+#ifndef USE_GSEIDEL
+			for (int r=0;r<size;r++) {
+				error+=abs(x[rows[r]]-xNew[rows[r]]);
+				x[rows[r]]=xNew[rows[r]];
+			}
 #endif
+			return error;
+		};
+		int iters=0;
+		while (++iters<MAX_ITERATIONS && iterateBlock() > 0); // Iterate until convergence
+		if (iters==MAX_ITERATIONS) {converged=false;}
+	};
 
+	for (int l=0;l<blocks.nrLevels() && converged;l++) {
+		int firstBlock = blocks.levelStart[l], endBlock = blocks.levelStart[l+1];
+		if (!pool || endBlock-firstBlock==1) {
+			for (int k=firstBlock;k<endBlock;k++) {solveBlock(k);}
+		}
+		else {
+			pool->run([&](int w) {
+				for (int k=firstBlock+w;k<endBlock && converged;k+=pool->size()) {solveBlock(k);}
+			});
 		}
 	}
+	return converged;
+}
 
-	// Calculate the error and set x to xNew for the next iteration
-	int error=0;
-	for (int i=0;i<nrOfEquations;i++) {
-		error+=abs(x[i]-xNew[i]);
-		x[i]=xNew[i];
+static bool multigridSolve(const CompressedRows& C, Multigrid& amg, const std::vector<int>& b, int* x, int* xNew, int nrOfEquations, bool bicgstab, int& iters) {
+	/* Multigrid mode (-amg), see Multigrid.h. The cycles run on doubles, either on their own, every cycle correcting
+	 * x with the residual, or as the preconditioner of BiCGSTAB (-bicgstab). After every iteration x is rounded to
+	 * integers, which is the answer once a Jacobi sweep leaves it unchanged. Returns false if that doesn't happen
+	 * within MAX_ITERATIONS
+	 */
+	int n=nrOfEquations;
+	std::vector<double> bd(b.begin(),b.end()),xd(n,0.0),r(bd),v(n,0.0),p(n,0.0),pHat(n),s(n),sHat(n),t(n);
+	auto solved = [&]() {
+		for (int i=0;i<n;i++) {
+			if (!(fabs(xd[i]) < INT_MAX)) {return false;} // Also if it is not a number
+			x[i] = (int)lround(xd[i]);
+		}
+		return C.sweep(b.data(),x,xNew,0)==0;
+	};
+	auto dot = [&](const std::vector<double>& u, const std::vector<double>& w) {
+		double sum=0;
+		for (int i=0;i<n;i++) {sum+=u[i]*w[i];}
+		return sum;
+	};
+
+	iters=0;
+	if (!bicgstab) {
+		/* With coarse levels, which only approximate the system, the correction of a cycle is scaled to make the residual
+		 * as small as possible. Without them a cycle is a number of Jacobi sweeps, and its correction is used as it is
+		 */
+		while (++iters<MAX_ITERATIONS) {
+			amg.cycle(r.data(),s.data());
+			amg.multiply(s.data(),t.data());
+			double scale=1;
+			if (amg.nrLevels()>1) {
+				double tt = dot(t,t);
+				if (tt==0) {return false;}
+				scale = dot(r,t)/tt;
+			}
+			for (int i=0;i<n;i++) {xd[i]+=scale*s[i]; r[i]-=scale*t[i];}
+			if (solved()) {return true;}
+		}
+		return false;
 	}
-	return error;
+
+	// Right preconditioned BiCGSTAB, from x = 0: https://en.wikipedia.org/wiki/Biconjugate_gradient_stabilized_method
+	const std::vector<double> rHat(r);
+	double rho=1,alpha=1,omega=1;
+	while (++iters<MAX_ITERATIONS) {
+		double rhoNew = dot(rHat,r);
+		if (rhoNew==0) {return false;} // Breakdown
+		double beta = (rhoNew/rho)*(alpha/omega);
+		for (int i=0;i<n;i++) {p[i] = r[i] + beta*(p[i]-omega*v[i]);}
+		amg.cycle(p.data(),pHat.data());
+		amg.multiply(pHat.data(),v.data());
+		alpha = rhoNew/dot(rHat,v);
+		for (int i=0;i<n;i++) {s[i] = r[i]-alpha*v[i]; xd[i] += alpha*pHat[i];}
+		if (solved()) {return true;}
+
+		amg.cycle(s.data(),sHat.data());
+		amg.multiply(sHat.data(),t.data());
+		double tt = dot(t,t);
+		omega = (tt==0) ? 0 : dot(t,s)/tt;
+		if (omega==0) {return false;}
+		for (int i=0;i<n;i++) {xd[i] += omega*sHat[i]; r[i] = s[i]-omega*t[i];}
+		rho=rhoNew;
+		if (solved()) {return true;}
+	}
+	return false;
 }
 
-int main(int argc, char** argv) {
-	if (argc<2) {std::cerr << "No equation file provided in command line argument" << std::endl; return -1;}
+struct BatchBuffers {
+	// What a batch thread reuses between the systems it solves
+	std::vector<ParsedEquation> equations;
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable,b,x,xNew;
+	SparseRows C;
+	CompressedRows compressed;
+	std::vector<std::pair<std::string,int>> varPairs;
+};
 
-	int maxIterations = MAX_ITERATIONS;
-	if (maxIterations<0 || maxIterations-MAX_ITERATIONS != 0) {
-		std::cerr << "Illegal format of MAX_ITERATIONS" << std::endl;
-		return -1;
+static void solveBatchSystem(const std::string& system, BatchBuffers& buffers, BatchResult& result) {
+	// Solves one system of a batch, on one thread, into what would have been printed to stdout and stderr
+	std::istringstream in(system);
+	std::ostringstream out,err;
+	if (!parseEquations(in,buffers.equations,buffers.variableList,buffers.rowOfVariable,err)) {result.err=err.str(); return;}
+	int nrOfEquations=buffers.equations.size();
+	if (nrOfEquations==0) {result.err="No equations in input file\n"; return;}
+
+	SparseRows& C = buffers.C;
+	C.rowStart.assign(1,0);
+	C.cols.clear();
+	C.coefs.clear();
+	buffers.b.clear();
+	for (int i=0;i<nrOfEquations;i++) {assembleRow(C,buffers.b,buffers.equations[i]);}
+	if (!resolveColumns(C,buffers.rowOfVariable,err)) {result.err=err.str(); return;}
+
+	buffers.compressed.encode(C.rowStart,C.cols,C.coefs,0,nrOfEquations);
+
+	buffers.x.assign(nrOfEquations,0);
+	buffers.xNew.assign(nrOfEquations,0);
+	int iters=0;
+	while (++iters<MAX_ITERATIONS && jacobiIterate(buffers.compressed,buffers.b.data(),buffers.x.data(),buffers.xNew.data(),nrOfEquations) > 0); // Iterate until convergence
+	if (iters==MAX_ITERATIONS) {result.err="Jacobi method did not converge\n"; return;}
+
+	buffers.varPairs.clear();
+	for (int i=0;i<nrOfEquations;i++) {
+		buffers.varPairs.push_back(std::make_pair(buffers.variableList[i],buffers.x[i]));
+	}
+	sort(buffers.varPairs.begin(),buffers.varPairs.end());
+	for (int i=0;i<nrOfEquations;i++) {
+		out << buffers.varPairs[i].first << " = " << buffers.varPairs[i].second << '\n';
+	}
+	result.out=out.str();
+}
+
+static int solveBatch(const char* batchFileName, int nrThreads) {
+	// Batch mode (-batch), see BatchPool.h. The file name - reads the systems from stdin
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::ifstream inFile;
+	bool fromStdin = std::string(batchFileName)=="-";
+	if (!fromStdin) {
+		inFile.open(batchFileName);
+		if (!inFile.is_open()) {std::cerr << "Unable to open file" << std::endl; return -1;}
 	}
 
-	// Start by reading the input file
+	std::vector<BatchBuffers> buffers(nrThreads);
+	int nrSystems = WorkStealingPool::run(fromStdin ? std::cin : inFile,nrThreads,[&](const std::string& system, int thread, BatchResult& result) {
+		solveBatchSystem(system,buffers[thread],result);
+	},printBatchResult);
+	std::cout.flush();
+	reportThroughput(nrSystems,start);
+	return 0;
+}
+
+static int jacobiDistributedRank(Transport& transport, const char* eqFileName) {
+	/* One process of the distributed Jacobi solver. The rows are split in contiguous blocks, one per process, and every
+	 * process only parses and stores its own rows, sparsely. Before every iteration the processes exchange the x
+	 * values that the other processes' rows reference (the halo), and the error is summed over all processes. At the
+	 * end, process 0 gathers x and prints the result
+	 */
+	int rank = transport.rank(), nrProcesses = transport.size();
 	std::unordered_map<std::string, int> variableMap;
 	std::vector<std::string> variableList;
 	std::ifstream inFile;
 	std::istringstream ss;
 	std::string line,token;
+	int nrOfEquations=0;
 
-	int** C,* b; // variable coefficients, equation constants
-	int* x,* xNew; // variables, variables in the new iteration
-
-	int lineIndex=0,nrOfEquations=0,iters=0;
-	bool firstToken=true;
-
-	inFile.open(argv[1]);
-	if (inFile.is_open()) {
-		while (getline(inFile,line)) {
-			ss.str(line);
-			ss.clear();
-			ss >> token;
-			variableMap.insert({token,nrOfEquations});
-			variableList.push_back(token);
-			nrOfEquations++;
-		}
-		if (nrOfEquations==0) {std::cerr << "No equations in input file" << std::endl;return-1;}
-
-		// Allocate the matrices, zero initialized with ()
-		C = new int*[nrOfEquations];
-		for (int i = 0; i < nrOfEquations;i++) {C[i] = new int[nrOfEquations]();}
-		b = new int[nrOfEquations]();
-		x = new int[nrOfEquations]();
-		xNew = new int[nrOfEquations]();
-
-		inFile.clear();
-		inFile.seekg(std::ios::beg); // Reset file pointer
-
-		while (getline(inFile,line)) {
-			C[lineIndex][lineIndex]=-1;
-			ss.str(line);
-			ss.clear();
-			while (ss >> token) {
-				if (firstToken) {firstToken=false;continue;}
-
-				if (isalpha(token[0])) {
-					C[lineIndex][variableMap.at(token)]++; // Add to coefficients
-				}
-				else if (isdigit(token[0])) {
-					b[lineIndex]+=std::stoi(token); // Assuming no int overflow here
-				}
+	inFile.open(eqFileName);
+	if (!inFile.is_open()) {
+		if (rank==0) {std::cerr << "Unable to open file" << std::endl;}
+		return -1;
+	}
+	// All processes need the variable names, to know which column a variable is
+	while (getline(inFile,line)) {
+		ss.str(line);
+		ss.clear();
+		ss >> token;
+		variableMap.insert({token,nrOfEquations});
+		variableList.push_back(token);
+		nrOfEquations++;
+	}
+	if (nrOfEquations==0) {
+		if (rank==0) {std::cerr << "No equations in input file" << std::endl;}
+		return -1;
+	}
+
+	std::vector<int> blockStart(nrProcesses+1);
+	for (int p=0;p<=nrProcesses;p++) {blockStart[p] = (long long)nrOfEquations*p/nrProcesses;}
+	int firstRow = blockStart[rank], nrOwnRows = blockStart[rank+1]-firstRow;
+
+	// Read the own rows into a sparse matrix (compressed rows), the diagonal is left out
+	std::vector<int> rowStart(1,0),cols,coefs,b(nrOwnRows,0);
+	inFile.clear();
+	inFile.seekg(std::ios::beg); // Reset file pointer
+	for (int lineIndex=0;lineIndex<blockStart[rank+1] && getline(inFile,line);lineIndex++) {
+		if (lineIndex<firstRow) {continue;}
+		std::vector<int> rowCols;
+		int diagonal=-1;
+		bool firstToken=true;
+		ss.str(line);
+		ss.clear();
+		while (ss >> token) {
+			if (firstToken) {firstToken=false;continue;}
+			if (isalpha(token[0])) {
+				int col = variableMap.at(token);
+				if (col==lineIndex) {diagonal++;}
+				else {rowCols.push_back(col);}
 			}
-			if (C[lineIndex][lineIndex]!=-1) {
-				/* C[lineIndex][lineIndex] cannot be zero. It is ok for it to be -1 or greater than 0. In the case it is not -1 or 0
-				 * then all the other coefficients and b[lineIndex] needs to be divided by that -coefficient. I assume that it never happens
-				 * here though, and only allow C[lineIndex][lineIndex] to be -1
-				 */
-				std::cerr << "Error, coefficient for diagonal variable is not 1" << std::endl;
-				return -1;
+			else if (isdigit(token[0])) {
+				b[lineIndex-firstRow]+=std::stoi(token); // Assuming no int overflow here
 			}
-			firstToken=true;
-			lineIndex++;
 		}
+		if (diagonal!=-1) {
+			std::cerr << "Error, coefficient for diagonal variable is not 1" << std::endl;
+			return -1;
+		}
+		sort(rowCols.begin(),rowCols.end());
+		for (size_t k=0;k<rowCols.size();k++) {
+			// Repeated variables add up to one coefficient
+			if (k>0 && rowCols[k]==rowCols[k-1]) {coefs.back()++;}
+			else {cols.push_back(rowCols[k]); coefs.push_back(1);}
+		}
+		rowStart.push_back(cols.size());
+	}
+	inFile.close();
+
+	/* Find the columns owned by other processes, and ask their owners for them. The local x vector holds the own
+	 * variables first, followed by the halo, grouped by owner
+	 */
+	std::vector<std::vector<int>> requests(nrProcesses),incomingRequests;
+	for (size_t k=0;k<cols.size();k++) {
+		if (cols[k]>=firstRow && cols[k]<firstRow+nrOwnRows) {continue;}
+		int owner = std::upper_bound(blockStart.begin(),blockStart.end(),cols[k]) - blockStart.begin() - 1;
+		requests[owner].push_back(cols[k]);
+	}
+	std::unordered_map<int,int> localIndex;
+	std::vector<int> haloStart(nrProcesses+1,nrOwnRows); // The halo from process p is x[haloStart[p]] to x[haloStart[p+1]-1]
+	int nrLocal = nrOwnRows;
+	for (int p=0;p<nrProcesses;p++) {
+		sort(requests[p].begin(),requests[p].end());
+		requests[p].erase(unique(requests[p].begin(),requests[p].end()),requests[p].end());
+		haloStart[p]=nrLocal;
+		for (size_t k=0;k<requests[p].size();k++) {localIndex[requests[p][k]] = nrLocal++;}
+	}
+	haloStart[nrProcesses]=nrLocal;
+	for (size_t k=0;k<cols.size();k++) {
+		if (cols[k]>=firstRow && cols[k]<firstRow+nrOwnRows) {cols[k]-=firstRow;}
+		else {cols[k]=localIndex[cols[k]];}
+	}
+	if (!exchangeVectors(transport,requests,incomingRequests)) {return -1;}
+	for (int p=0;p<nrProcesses;p++) {
+		// The values the other processes ask for, as indices into x
+		for (size_t k=0;k<incomingRequests[p].size();k++) {incomingRequests[p][k]-=firstRow;}
+	}
+
+	std::vector<int> x(nrLocal,0),xNew(nrOwnRows,0);
+	std::vector<std::vector<char>> haloOut(nrProcesses),haloIn(nrProcesses);
+	for (int p=0;p<nrProcesses;p++) {
+		if (p==rank) {continue;}
+		haloOut[p].resize(incomingRequests[p].size()*sizeof(int));
+		haloIn[p].resize(requests[p].size()*sizeof(int));
+	}
+
+	int iters=0;
+	long long error=1;
+	while (++iters<MAX_ITERATIONS) {
+		// Send the requested own values, and receive the halo
+		for (int p=0;p<nrProcesses;p++) {
+			if (p==rank) {continue;}
+			int* out = (int*)haloOut[p].data();
+			for (size_t k=0;k<incomingRequests[p].size();k++) {out[k] = x[incomingRequests[p][k]];}
+		}
+		if (!transport.exchange(haloOut,haloIn)) {return -1;}
+		for (int p=0;p<nrProcesses;p++) {
+			if (p==rank) {continue;}
+			const int* in = (const int*)haloIn[p].data();
+			std::copy(in,in+requests[p].size(),x.begin()+haloStart[p]);
+		}
+
+		error=0;
+		for (int i=0;i<nrOwnRows;i++) {
+			xNew[i]=b[i];
+			for (int k=rowStart[i];k<rowStart[i+1];k++) {xNew[i]+=coefs[k] * x[cols[k]];}
+		}
+		for (int i=0;i<nrOwnRows;i++) {
+			error+=abs(x[i]-xNew[i]);
+			x[i]=xNew[i];
+		}
+		if (!allReduceSum(transport,error)) {return -1;}
+		if (error==0) {break;}
+	}
+
+	if (iters==MAX_ITERATIONS) {
+		if (rank==0) {std::cerr << "Jacobi method did not converge" << std::endl;}
+		return -1;
 	}
+
+	// Gather x in process 0
+	std::vector<std::vector<char>> gatherOut(nrProcesses),gatherIn(nrProcesses);
+	if (rank!=0) {gatherOut[0].assign((char*)x.data(),(char*)(x.data()+nrOwnRows));}
 	else {
-		std::cerr << "Unable to open file" << std::endl;
+		for (int p=1;p<nrProcesses;p++) {gatherIn[p].resize((blockStart[p+1]-blockStart[p])*sizeof(int));}
+	}
+	if (!transport.exchange(gatherOut,gatherIn)) {return -1;}
+	if (rank!=0) {return 0;}
+
+	std::vector<std::pair<std::string,int>> varPairs;
+	varPairs.reserve(nrOfEquations);
+	for (int p=0;p<nrProcesses;p++) {
+		const int* values = (p==0) ? x.data() : (const int*)gatherIn[p].data();
+		for (int i=blockStart[p];i<blockStart[p+1];i++) {
+			varPairs.push_back(std::make_pair(variableList[i],values[i-blockStart[p]]));
+		}
+	}
+
+	// Sort the strings:
+	sort( varPairs.begin(), varPairs.end());
+
+	// Print the result:
+	for (int i=0;i<nrOfEquations;i++) {
+		std::cout << varPairs[i].first << " = " << varPairs[i].second << std::endl;
+	}
+	return 0;
+}
+
+static int solveDistributed(const char* eqFileName, int nrProcesses) {
+	// Starts nrProcesses-1 more processes, connected to this one (which becomes process 0) with Unix sockets
+	UnixSocketTransport transport(nrProcesses);
+	std::vector<pid_t> children;
+	int rank=0;
+
+	for (int p=1;p<nrProcesses;p++) {
+		pid_t pid = fork();
+		if (pid<0) {std::cerr << "Unable to start process" << std::endl; break;} // The missing process makes the others fail
+		if (pid==0) {rank=p; break;}
+		children.push_back(pid);
+	}
+	transport.becomeRank(rank);
+
+	int result = jacobiDistributedRank(transport,eqFileName);
+	if (rank!=0) {exit(result==0 ? 0 : 1);}
+	transport.close(); // If this process failed early, the others are still waiting in an exchange with it
+
+	for (size_t i=0;i<children.size();i++) {
+		int status;
+		waitpid(children[i],&status,0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) {result=-1;}
+	}
+	return result;
+}
+
+int main(int argc, char** argv) {
+	if (argc<2) {std::cerr << "No equation file provided in command line argument" << std::endl; return -1;}
+
+	int maxIterations = MAX_ITERATIONS;
+	if (maxIterations<0 || maxIterations-MAX_ITERATIONS != 0) {
+		std::cerr << "Illegal format of MAX_ITERATIONS" << std::endl;
 		return -1;
 	}
 
-	inFile.close();
+	int nrThreads=1,nrProcesses=0;
+	bool numaReport=false,blockTriangular=false,threadsGiven=false,batch=false,matrixReport=false,reorder=false,amg=false,bicgstab=false;
+	for (int i=2;i<argc;i++) {
+		std::string arg(argv[i]);
+		if (arg=="-threads" && i+1<argc) {nrThreads=atoi(argv[++i]); threadsGiven=true;}
+		else if (arg=="-processes" && i+1<argc) {nrProcesses=atoi(argv[++i]);}
+		else if (arg=="-numareport") {numaReport=true;}
+		else if (arg=="-btf") {blockTriangular=true;}
+		else if (arg=="-batch") {batch=true;}
+		else if (arg=="-matrixreport") {matrixReport=true;}
+		else if (arg=="-reorder") {reorder=true;}
+		else if (arg=="-amg") {amg=true;}
+		else if (arg=="-bicgstab") {bicgstab=true;}
+		else {std::cerr << "Unknown argument " << arg << std::endl; return -1;}
+	}
+	if (nrThreads<1) {std::cerr << "Number of threads must be positive" << std::endl; return -1;}
+	if (bicgstab && !amg) {std::cerr << "-bicgstab is only used with -amg" << std::endl; return -1;}
+	if (amg && (batch || nrProcesses>0 || blockTriangular)) {std::cerr << "-amg can't be combined with -batch, -processes or -btf" << std::endl; return -1;}
+	if (batch) {
+		if (reorder) {std::cerr << "-reorder can't be combined with -batch" << std::endl; return -1;}
+		if (nrProcesses>0) {std::cerr << "-processes can't be combined with -batch" << std::endl; return -1;}
+		if (blockTriangular) {std::cerr << "-btf can't be combined with -batch" << std::endl; return -1;}
+		if (numaReport) {std::cerr << "-numareport can't be combined with -batch" << std::endl; return -1;}
+		if (matrixReport) {std::cerr << "-matrixreport can't be combined with -batch" << std::endl; return -1;}
+		// Every system is solved on one thread, with one system per core at a time unless -threads is given
+		if (!threadsGiven) {nrThreads = std::max(1u,std::thread::hardware_concurrency());}
+		return solveBatch(argv[1],nrThreads);
+	}
+	if (nrProcesses>0) {
+		if (blockTriangular) {std::cerr << "-btf can't be combined with -processes" << std::endl; return -1;}
+		if (reorder) {std::cerr << "-reorder can't be combined with -processes" << std::endl; return -1;}
+#ifdef USE_GSEIDEL
+		std::cerr << "The Gauss-Seidel method can't be distributed, using the Jacobi method" << std::endl;
+#endif
+		return solveDistributed(argv[1],nrProcesses);
+	}
+#ifdef USE_GSEIDEL
+	if (nrThreads>1 && !blockTriangular && !amg) {
+		std::cerr << "The Gauss-Seidel method can't be run in parallel, using one thread" << std::endl;
+		nrThreads=1;
+	}
+#endif
+	WorkerPool* pool = (nrThreads>1) ? new WorkerPool(nrThreads) : NULL;
+
+	/* Read the input file. The rows are assembled into the sparse matrix while the later rows are still being read
+	 * and parsed, see EquationPipeline.h. Until the whole file is read, the columns are variable ids
+	 */
+	SparseRows C;
+	std::vector<int> b;
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable;
+	int iters=0;
+
+	bool readOk = readEquationsPipelined(argv[1],[&](ParsedEquation& equation) {
+		assembleRow(C,b,equation);
+	},variableList,rowOfVariable);
+	if (!readOk) {return -1;}
+
+	int nrOfEquations=b.size();
+	if (nrOfEquations==0) {std::cerr << "No equations in input file" << std::endl;return-1;}
+	if (!resolveColumns(C,rowOfVariable,std::cerr)) {return -1;}
+
+	if (reorder) {
+		// Reverse Cuthill-McKee, see Reordering.h
+		std::vector<int> order;
+		std::cerr << "Before reordering: " << describeOrdering(nrOfEquations,C.rowStart,C.cols) << std::endl;
+		reverseCuthillMcKee(nrOfEquations,C.rowStart,C.cols,order);
+		permuteRows(C,b,variableList,order);
+		std::cerr << "After reordering: " << describeOrdering(nrOfEquations,C.rowStart,C.cols) << std::endl;
+	}
+
+	int* x = new int[nrOfEquations](); // variables
+	int* xNew = new int[nrOfEquations](); // variables in the new iteration
 
-	while (++iters<MAX_ITERATIONS && jacobiIterate(C,b,x,xNew,nrOfEquations) > 0); // Iterate until convergence
+	if (amg) {
+		// The setup of the hierarchy runs on the threads, the cycles on one
+		CompressedRows compressed;
+		compressed.encode(C.rowStart,C.cols,C.coefs,0,nrOfEquations);
+		Multigrid multigrid;
+		multigrid.setup(C.rowStart,C.cols,C.coefs,compressed,pool);
+		C = SparseRows();
+		delete pool;
+		if (matrixReport) {std::cerr << "Matrix: " << compressed.description() << std::endl << multigrid.description() << std::endl;}
 
-	if (iters==MAX_ITERATIONS) {std::cerr << "Jacobi method did not converge" << std::endl;return-1;}
+		bool solved = multigridSolve(compressed,multigrid,b,x,xNew,nrOfEquations,bicgstab,iters);
+		if (matrixReport) {std::cerr << "Multigrid: " << iters << " iterations" << std::endl;}
+		if (!solved) {std::cerr << "Multigrid method did not converge" << std::endl; return -1;}
+	}
+	else if (blockTriangular) {
+		if (!jacobiSolveBlocks(C,b,x,nrOfEquations,pool)) {iters=MAX_ITERATIONS;}
+		delete pool;
+	}
+	else if (pool) {
+		// Every worker encodes the rows it owns, so that they are placed on its NUMA node
+		std::vector<CompressedRows> blocks(pool->size());
+		pool->run([&](int w) {
+			blocks[w].encode(C.rowStart,C.cols,C.coefs,pool->blockStart(w,nrOfEquations),pool->blockEnd(w,nrOfEquations));
+		});
+		C = SparseRows();
+		if (matrixReport) {
+			for (int w=0;w<pool->size();w++) {std::cerr << "Rows of worker " << w << ": " << blocks[w].description() << std::endl;}
+		}
+
+		while (++iters<MAX_ITERATIONS && jacobiIterateParallel(*pool,blocks,b.data(),x,xNew,nrOfEquations) > 0); // Iterate until convergence
+		if (numaReport) {pool->reportBandwidth(std::cerr);}
+		delete pool;
+	}
+	else {
+		CompressedRows compressed;
+		compressed.encode(C.rowStart,C.cols,C.coefs,0,nrOfEquations);
+		C = SparseRows();
+		if (matrixReport) {std::cerr << "Matrix: " << compressed.description() << std::endl;}
+		while (++iters<MAX_ITERATIONS && jacobiIterate(compressed,b.data(),x,xNew,nrOfEquations) > 0); // Iterate until convergence
+	}
+
+	if (iters==MAX_ITERATIONS) {std::cerr << "Jacobi method did not converge" << std::endl; return -1;}
 
 	// Associate each variable string with its value:
 	std::vector<std::pair<std::string,int>> varPairs;
@@ -140,11 +655,6 @@ int main(int argc, char** argv) {
 		std::cout << varPairs[i].first << " = " << varPairs[i].second << std::endl;
 	}
 
-	for (int i = 0; i < nrOfEquations; ++i) {
-		delete[] C[i];
-	}
-	delete[] C;
-	delete[] b;
 	delete[] x;
 	delete[] xNew;
 }
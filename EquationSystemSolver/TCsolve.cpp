@@ -0,0 +1,412 @@
+//============================================================================
+// Name        : TCsolve.cpp
+// Author      : Niklas Bergh
+//============================================================================
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "EquationPipeline.h"
+#include "BlockTriangular.h"
+
+/* Front end that picks the solver for an equation system. The system is read and analyzed (size, density, diagonal
+ * dominance, symmetry, and whether the variables depend on each other in cycles), the running time of every solver
+ * that can solve it is predicted with a cost model, and the fastest one is run as a child process. The solvers are
+ * looked for in the directory of TCsolve (and TCcalc in GeneralSolver under it as well):
+ *
+ * TCcalcJacobi            the sparse Jacobi solver, plain or with -btf
+ * TCcalcGaussSeidel       TCcalcJacobi compiled with -DUSE_GSEIDEL
+ * TCcalcJacobiParallel    the GPU solver
+ * TCcalc                  dense LU factorization, plain or with -btf
+ *
+ * Missing solvers are skipped, only TCcalc is required. If an iterative solver fails (doesn't converge, has no GPU,
+ * or takes STALL_FACTOR times its predicted time), its output is thrown away and the system is solved with LU
+ * instead
+ */
+
+/* The cost model, in seconds. The defaults are measured on my system, ./TCsolve -calibrate measures them on the
+ * machine it runs on and prints them as -D flags to compile TCsolve with
+ */
+#ifndef COST_PARSE_TERM
+#define COST_PARSE_TERM 3.0e-7 // Reading one variable or constant of the input file
+#endif
+#ifndef COST_SPARSE_ENTRY
+#define COST_SPARSE_ENTRY 1.5e-9 // One nonzero of the sparse matrix in one iteration
+#endif
+#ifndef COST_DENSE_ENTRY
+#define COST_DENSE_ENTRY 8.0e-9 // Allocating and filling one entry of a dense matrix
+#endif
+#ifndef COST_LU_FLOP
+#define COST_LU_FLOP 8.0e-10 // One multiply and subtract of the LU factorization
+#endif
+#ifndef COST_GPU_STARTUP
+#define COST_GPU_STARTUP 0.15 // Creating the CUDA context
+#endif
+#ifndef COST_GPU_ENTRY
+#define COST_GPU_ENTRY 4.0e-11 // One entry of the dense matrix on the GPU in one iteration, including the copy to it
+#endif
+#ifndef GPU_MEMORY_MB
+#define GPU_MEMORY_MB 2048 // The largest matrix the GPU solver is given
+#endif
+
+#ifndef MAX_ITERATIONS
+#define MAX_ITERATIONS 50 // Has to be the same as in the iterative solvers
+#endif
+
+#ifndef STALL_FACTOR
+#define STALL_FACTOR 10 // An iterative solver is stopped after this many times its predicted time, plus a second
+#endif
+
+struct SystemAnalysis {
+	int nrEquations;
+	long long nrTerms; // Variables and constants in the file
+	long long nonZeros; // Off diagonal nonzeros of the matrix
+	int selfReferences; // Equations with their own variable on the right hand side, the iterative solvers reject them
+	int dominantRows; // Rows of the matrix that are strictly diagonally dominant
+	long long symmetricEntries; // Off diagonal nonzeros (i,j) with an equal nonzero at (j,i)
+	bool acyclic; // No variable depends on itself through other variables
+	int jacobiIterations,gaussSeidelIterations; // Iterations until the solvers stop, if acyclic
+	int nrBlocks,largestBlock; // Diagonal blocks of the block triangular form
+	double blockFlops; // LU flops of factorizing only the diagonal blocks
+};
+
+struct Method {
+	std::string description; // Printed by -explain
+	std::vector<std::string> command;
+	double seconds; // Predicted
+	bool iterative;
+};
+
+static bool analyzeSystem(const char* eqFileName, SystemAnalysis& analysis) {
+	/* The matrix is A = I - C, with C the coefficients of the variables on the right hand sides. C is stored sparsely
+	 * and only used to find the structure of A
+	 */
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable,rowStart(1,0),cols,coefs;
+	long long nrTerms=0;
+
+	bool readOk = readEquationsPipelined(eqFileName,[&](ParsedEquation& equation) {
+		std::vector<int>& terms = equation.terms;
+		nrTerms += terms.size()+1;
+		sort(terms.begin(),terms.end());
+		for (size_t t=0;t<terms.size();t++) {
+			if (t>0 && terms[t]==terms[t-1]) {coefs.back()++;}
+			else {cols.push_back(terms[t]); coefs.push_back(1);}
+		}
+		rowStart.push_back(cols.size());
+	},variableList,rowOfVariable);
+	if (!readOk) {return false;}
+
+	int n=rowStart.size()-1;
+	if (n==0) {std::cerr << "No equations in input file" << std::endl; return false;}
+	analysis.nrEquations=n;
+	analysis.nrTerms=nrTerms;
+	analysis.selfReferences=0;
+	analysis.dominantRows=0;
+	analysis.symmetricEntries=0;
+
+	// Columns instead of variable ids, sorted within the rows. The diagonal is taken out of C
+	std::vector<std::pair<int,int>> row;
+	std::vector<int> offRowStart(1,0),offCols,offCoefs;
+	for (int i=0;i<n;i++) {
+		row.clear();
+		for (int k=rowStart[i];k<rowStart[i+1];k++) {row.push_back(std::make_pair(rowOfVariable[cols[k]],coefs[k]));}
+		sort(row.begin(),row.end());
+		long long offDiagonalSum=0;
+		for (size_t k=0;k<row.size();k++) {
+			if (row[k].first==i) {analysis.selfReferences++; continue;}
+			offCols.push_back(row[k].first);
+			offCoefs.push_back(row[k].second);
+			offDiagonalSum += row[k].second;
+		}
+		offRowStart.push_back(offCols.size());
+		if (offDiagonalSum<1) {analysis.dominantRows++;} // The diagonal of A is 1 (unless self referencing)
+	}
+	analysis.nonZeros=offCols.size();
+
+	for (int i=0;i<n;i++) {
+		for (int k=offRowStart[i];k<offRowStart[i+1];k++) {
+			int j=offCols[k];
+			std::vector<int>::iterator first = offCols.begin()+offRowStart[j], last = offCols.begin()+offRowStart[j+1];
+			std::vector<int>::iterator match = std::lower_bound(first,last,i);
+			if (match!=last && *match==i && offCoefs[match-offCols.begin()]==offCoefs[k]) {analysis.symmetricEntries++;}
+		}
+	}
+
+	BlockDecomposition blocks;
+	findBlocks(n,offRowStart,offCols,blocks);
+	analysis.nrBlocks=blocks.nrBlocks();
+	analysis.largestBlock=0;
+	analysis.blockFlops=0;
+	for (int k=0;k<blocks.nrBlocks();k++) {
+		double size=blocks.blockSize(k);
+		analysis.largestBlock = std::max(analysis.largestBlock,blocks.blockSize(k));
+		analysis.blockFlops += size*size*size/3;
+	}
+	analysis.acyclic = (analysis.largestBlock==1 && analysis.selfReferences==0);
+
+	/* Without cycles the iterations are known exactly: a row gets its final value in the iteration after its last
+	 * dependency does (Jacobi), or in the same one if the dependency comes before it (Gauss-Seidel). One more
+	 * iteration finds that nothing changes. The blocks are ordered with their dependencies first
+	 */
+	analysis.jacobiIterations=analysis.gaussSeidelIterations=0;
+	if (analysis.acyclic) {
+		std::vector<int> jacobiDone(n),gaussSeidelDone(n);
+		for (int i : blocks.rows) {
+			jacobiDone[i]=gaussSeidelDone[i]=1;
+			for (int k=offRowStart[i];k<offRowStart[i+1];k++) {
+				int j=offCols[k];
+				jacobiDone[i] = std::max(jacobiDone[i],jacobiDone[j]+1);
+				gaussSeidelDone[i] = std::max(gaussSeidelDone[i],gaussSeidelDone[j] + ((j<i) ? 0 : 1));
+			}
+			analysis.jacobiIterations = std::max(analysis.jacobiIterations,jacobiDone[i]+1);
+			analysis.gaussSeidelIterations = std::max(analysis.gaussSeidelIterations,gaussSeidelDone[i]+1);
+		}
+	}
+	return true;
+}
+
+static void explainAnalysis(const SystemAnalysis& analysis) {
+	double n=analysis.nrEquations;
+	std::cerr << "Equations: " << analysis.nrEquations << std::endl;
+	std::cerr << "Off diagonal nonzeros: " << analysis.nonZeros << " (density " << analysis.nonZeros/(n*n) << ")" << std::endl;
+	std::cerr << "Strictly diagonally dominant rows: " << analysis.dominantRows << std::endl;
+	std::cerr << "Symmetric nonzeros: " << analysis.symmetricEntries << std::endl;
+	std::cerr << "Self referencing equations: " << analysis.selfReferences << std::endl;
+	std::cerr << "Diagonal blocks: " << analysis.nrBlocks << ", the largest with " << analysis.largestBlock << " equations" << std::endl;
+	if (analysis.acyclic) {
+		std::cerr << "No cycles, Jacobi stops after " << analysis.jacobiIterations << " iterations and Gauss-Seidel after "
+				<< analysis.gaussSeidelIterations << std::endl;
+	}
+}
+
+static bool isExecutable(const std::string& path) {return access(path.c_str(),X_OK)==0;}
+
+static std::vector<Method> predictMethods(const SystemAnalysis& analysis, const std::string& solverDir, int nrThreads) {
+	std::vector<Method> methods;
+	double n=analysis.nrEquations, entries=analysis.nonZeros+n, read=COST_PARSE_TERM*analysis.nrTerms;
+	std::vector<std::string> threadArgs;
+	if (nrThreads>1) {threadArgs = {"-threads",std::to_string(nrThreads)};}
+
+	/* The iterative solvers only find the solution if they converge. With the non negative coefficients of these
+	 * systems they do if there are no cycles, or if A is strictly diagonally dominant, and then in at most the
+	 * iterations found by analyzeSystem (or MAX_ITERATIONS, if only diagonally dominant)
+	 */
+	bool converges = analysis.selfReferences==0 && (analysis.acyclic || analysis.dominantRows==analysis.nrEquations);
+	int jacobiIterations = analysis.acyclic ? analysis.jacobiIterations : MAX_ITERATIONS;
+	int gaussSeidelIterations = analysis.acyclic ? analysis.gaussSeidelIterations : MAX_ITERATIONS;
+
+	std::string jacobi=solverDir+"TCcalcJacobi",gaussSeidel=solverDir+"TCcalcGaussSeidel",gpu=solverDir+"TCcalcJacobiParallel";
+	std::string lu = isExecutable(solverDir+"TCcalc") ? solverDir+"TCcalc" : solverDir+"GeneralSolver/TCcalc";
+
+	if (isExecutable(jacobi) && analysis.acyclic) {
+		// The blocks are all single equations, solved by substitution in one pass (after one more to find them)
+		Method method = {"Jacobi, block triangular",{jacobi,"","-btf"},read+COST_SPARSE_ENTRY*entries*2,true};
+		methods.push_back(method);
+	}
+	if (isExecutable(jacobi) && converges && jacobiIterations<MAX_ITERATIONS) {
+		Method method = {"Jacobi",{jacobi,""},read+COST_SPARSE_ENTRY*entries*jacobiIterations/nrThreads,true};
+		method.command.insert(method.command.end(),threadArgs.begin(),threadArgs.end());
+		methods.push_back(method);
+	}
+	if (isExecutable(gaussSeidel) && converges && gaussSeidelIterations<MAX_ITERATIONS) {
+		Method method = {"Gauss-Seidel",{gaussSeidel,""},read+COST_SPARSE_ENTRY*entries*gaussSeidelIterations,true};
+		methods.push_back(method);
+	}
+	if (isExecutable(gpu) && converges && jacobiIterations<MAX_ITERATIONS && n*n*sizeof(int) <= GPU_MEMORY_MB*1048576.0) {
+		// Stores the matrix densely, on the host and on the GPU
+		Method method = {"Jacobi on the GPU",{gpu,""},read+COST_DENSE_ENTRY*n*n+COST_GPU_STARTUP+COST_GPU_ENTRY*n*n*jacobiIterations,true};
+		methods.push_back(method);
+	}
+
+	// LU always works (unless the matrix is singular, and then nothing else does either)
+	Method method = {"LU factorization",{lu,""},read+COST_DENSE_ENTRY*n*n+COST_LU_FLOP*n*n*n/3/nrThreads,false};
+	double memoryBytes = (double)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGE_SIZE);
+	if (memoryBytes>0 && n*n*sizeof(double) > memoryBytes/2) {
+		// Doesn't fit in memory, use a quarter of it
+		method.description += ", out of core";
+		method.command.push_back("-ooc");
+		method.command.push_back(std::to_string((long long)(memoryBytes/4/1048576)));
+	}
+	else {method.command.insert(method.command.end(),threadArgs.begin(),threadArgs.end());}
+	methods.push_back(method);
+
+	if (analysis.nrBlocks>1) {
+		Method blockMethod = {"LU factorization, block triangular",{lu,"","-btf"},
+				read+COST_SPARSE_ENTRY*entries*2+COST_DENSE_ENTRY*analysis.largestBlock*n+COST_LU_FLOP*analysis.blockFlops/nrThreads,false};
+		blockMethod.command.insert(blockMethod.command.end(),threadArgs.begin(),threadArgs.end());
+		methods.push_back(blockMethod);
+	}
+	return methods;
+}
+
+static int runSolver(const Method& method, const char* eqFileName, double timeLimit, std::string& out, std::string& err) {
+	/* Runs the solver with the equation file as its first argument and collects what it prints. Returns its exit
+	 * status, or -1 if it couldn't be started, was killed or ran longer than timeLimit seconds (if positive)
+	 */
+	std::vector<std::string> command(method.command);
+	command[1]=eqFileName;
+	std::vector<char*> args;
+	for (size_t a=0;a<command.size();a++) {args.push_back(&command[a][0]);}
+	args.push_back(NULL);
+
+	int outPipe[2],errPipe[2];
+	if (pipe(outPipe)!=0 || pipe(errPipe)!=0) {err="Unable to create pipe\n"; return -1;}
+	pid_t child = fork();
+	if (child<0) {err="Unable to fork\n"; return -1;}
+	if (child==0) {
+		dup2(outPipe[1],1);
+		dup2(errPipe[1],2);
+		close(outPipe[0]); close(outPipe[1]); close(errPipe[0]); close(errPipe[1]);
+		execv(args[0],args.data());
+		_exit(127);
+	}
+	close(outPipe[1]);
+	close(errPipe[1]);
+
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeLimit));
+	bool timedOut=false;
+	pollfd fds[2] = {{outPipe[0],POLLIN,0},{errPipe[0],POLLIN,0}};
+	std::string* targets[2] = {&out,&err};
+	int nrOpen=2;
+	char buffer[65536];
+	while (nrOpen>0) {
+		int timeout=-1;
+		if (timeLimit>0) {
+			long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+			if (left<=0) {timedOut=true; kill(child,SIGKILL); break;}
+			timeout=(int)std::min(left,1000LL);
+		}
+		if (poll(fds,2,timeout)<0) {continue;}
+		for (int f=0;f<2;f++) {
+			if (fds[f].fd<0 || !fds[f].revents) {continue;}
+			ssize_t bytes = read(fds[f].fd,buffer,sizeof(buffer));
+			if (bytes>0) {targets[f]->append(buffer,bytes);}
+			else {close(fds[f].fd); fds[f].fd=-1; nrOpen--;} // Closed by the solver
+		}
+	}
+	for (int f=0;f<2;f++) {if (fds[f].fd>=0) {close(fds[f].fd);}}
+
+	int status;
+	while (waitpid(child,&status,0)<0) {}
+	if (timedOut || !WIFEXITED(status) || WEXITSTATUS(status)==127) {return -1;}
+	return WEXITSTATUS(status);
+}
+
+static void calibrate() {
+	/* Times the inner loops the cost model is made of, and prints them as the flags to compile TCsolve with. Parsing
+	 * is timed on generated lines, the sparse iterations on a random sparse matrix
+	 */
+	typedef std::chrono::steady_clock clock;
+	auto secondsSince = [](clock::time_point start) {return std::chrono::duration<double>(clock::now()-start).count();};
+	std::mt19937 random(1);
+
+	// Parsing, 10 terms per line
+	std::ostringstream generated;
+	const int nrLines=100000;
+	for (int i=0;i<nrLines;i++) {
+		generated << "v" << i << " = ";
+		for (int t=0;t<9;t++) {generated << "v" << random()%nrLines << " + ";}
+		generated << random()%1000 << '\n';
+	}
+	std::istringstream in(generated.str());
+	std::vector<ParsedEquation> equations;
+	std::vector<std::string> variableList;
+	std::vector<int> rowOfVariable;
+	clock::time_point start = clock::now();
+	parseEquations(in,equations,variableList,rowOfVariable,std::cerr);
+	double parseTerm = secondsSince(start)/(nrLines*11.0);
+
+	// Sparse iterations, 10 nonzeros per row
+	const int nrRows=200000,rowLength=10,nrIterations=10;
+	std::vector<int> cols(nrRows*rowLength),coefs(nrRows*rowLength,1),x(nrRows,1),xNew(nrRows);
+	for (size_t k=0;k<cols.size();k++) {cols[k]=random()%nrRows;}
+	start = clock::now();
+	for (int iter=0;iter<nrIterations;iter++) {
+		for (int i=0;i<nrRows;i++) {
+			int sum=1;
+			for (int k=i*rowLength;k<(i+1)*rowLength;k++) {sum += coefs[k]*x[cols[k]];}
+			xNew[i]=sum&1023;
+		}
+		x.swap(xNew);
+	}
+	double sparseEntry = secondsSince(start)/((double)nrIterations*nrRows*(rowLength+1));
+	volatile int sink=x[0]; (void)sink;
+
+	// Dense allocation and LU elimination
+	const int n=600;
+	start = clock::now();
+	std::vector<double*> A(n);
+	for (int i=0;i<n;i++) {A[i] = new double[n]();}
+	for (int i=0;i<n;i++) {
+		for (int j=0;j<n;j++) {A[i][j] = (i==j) ? n : (double)(random()%100)/100;}
+	}
+	double denseEntry = secondsSince(start)/((double)n*n);
+	start = clock::now();
+	for (int k=0;k<n;k++) {
+		for (int i=k+1;i<n;i++) {
+			double factor = A[i][k]/A[k][k];
+			for (int j=k+1;j<n;j++) {A[i][j] -= factor*A[k][j];}
+		}
+	}
+	double luFlop = secondsSince(start)/((double)n*n*n/3);
+	sink=(int)A[n-1][n-1];
+	for (int i=0;i<n;i++) {delete[] A[i];}
+
+	std::cout << "-DCOST_PARSE_TERM=" << parseTerm << " -DCOST_SPARSE_ENTRY=" << sparseEntry
+			<< " -DCOST_DENSE_ENTRY=" << denseEntry << " -DCOST_LU_FLOP=" << luFlop << std::endl;
+}
+
+int main(int argc, char** argv) {
+	if (argc<2) {std::cerr << "No equation file provided in command line argument" << std::endl; return -1;}
+	if (std::string(argv[1])=="-calibrate") {calibrate(); return 0;}
+
+	int nrThreads=1;
+	bool explain=false;
+	for (int i=2;i<argc;i++) {
+		std::string arg(argv[i]);
+		if (arg=="-threads" && i+1<argc) {nrThreads=atoi(argv[++i]);}
+		else if (arg=="-explain") {explain=true;}
+		else {std::cerr << "Unknown argument " << arg << std::endl; return -1;}
+	}
+	if (nrThreads<1) {std::cerr << "Number of threads must be positive" << std::endl; return -1;}
+
+	SystemAnalysis analysis = SystemAnalysis();
+	if (!analyzeSystem(argv[1],analysis)) {return -1;}
+	if (explain) {explainAnalysis(analysis);}
+
+	std::string program(argv[0]);
+	std::string solverDir = (program.rfind('/')==std::string::npos) ? "./" : program.substr(0,program.rfind('/')+1);
+	std::vector<Method> methods = predictMethods(analysis,solverDir,nrThreads);
+	std::stable_sort(methods.begin(),methods.end(),[](const Method& a, const Method& b) {return a.seconds<b.seconds;});
+	if (explain) {
+		for (size_t m=0;m<methods.size();m++) {std::cerr << "Predicted " << methods[m].seconds << " s for " << methods[m].description << std::endl;}
+	}
+
+	// The fastest method, and if it is iterative and fails, the fastest direct one
+	for (size_t m=0;m<methods.size();m++) {
+		if (m>0 && methods[m].iterative) {continue;}
+		if (explain) {std::cerr << "Solving with " << methods[m].description << std::endl;}
+		std::string out,err;
+		double timeLimit = methods[m].iterative ? STALL_FACTOR*methods[m].seconds+1 : 0;
+		int status = runSolver(methods[m],argv[1],timeLimit,out,err);
+		if (status!=0 && methods[m].iterative) {
+			if (explain) {std::cerr << methods[m].description << " failed: " << (err.empty() ? "stalled\n" : err);}
+			continue;
+		}
+		std::cout << out;
+		std::cerr << err;
+		return status;
+	}
+	return -1;
+}
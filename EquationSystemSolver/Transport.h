@@ -0,0 +1,177 @@
+//============================================================================
+// Name        : Transport.h
+// Author      : Niklas Bergh
+//============================================================================
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* Message passing between the cooperating processes of the distributed solvers. A transport connects size()
+ * processes, numbered 0 to size()-1. The only primitive is exchange, where every process sends one message to every
+ * other process and receives one from each of them (messages may be empty). Collectives like the error reduction
+ * and the gather of the results are built on top of it. Other transports (TCP, MPI) only need to implement
+ * exchange
+ */
+
+class Transport {
+public:
+	virtual ~Transport() {}
+	virtual int rank() const = 0;
+	virtual int size() const = 0;
+
+	/* Sends out[peer] to every peer, and receives in[peer] from every peer. The receiver must know the size of every
+	 * message, in[peer] has to be resized to it before the call. out[rank()] and in[rank()] are not used. Returns
+	 * false if a peer has gone away
+	 */
+	virtual bool exchange(const std::vector<std::vector<char>>& out, std::vector<std::vector<char>>& in) = 0;
+};
+
+template <typename T>
+static bool exchangeVectors(Transport& transport, const std::vector<std::vector<T>>& out, std::vector<std::vector<T>>& in) {
+	// Exchange of messages whose sizes the receiver doesn't know. The sizes are sent first
+	int size = transport.size();
+	std::vector<std::vector<char>> outBytes(size), inBytes(size);
+
+	for (int peer=0;peer<size;peer++) {
+		if (peer==transport.rank()) {continue;}
+		long long count = out[peer].size();
+		outBytes[peer].assign((char*)&count,(char*)&count + sizeof(count));
+		inBytes[peer].resize(sizeof(count));
+	}
+	if (!transport.exchange(outBytes,inBytes)) {return false;}
+
+	in.assign(size,std::vector<T>());
+	for (int peer=0;peer<size;peer++) {
+		if (peer==transport.rank()) {continue;}
+		long long count = *(long long*)inBytes[peer].data();
+		outBytes[peer].assign((const char*)out[peer].data(),(const char*)(out[peer].data() + out[peer].size()));
+		inBytes[peer].resize(count*sizeof(T));
+	}
+	if (!transport.exchange(outBytes,inBytes)) {return false;}
+
+	for (int peer=0;peer<size;peer++) {
+		if (peer==transport.rank()) {continue;}
+		in[peer].resize(inBytes[peer].size()/sizeof(T));
+		std::copy(inBytes[peer].begin(),inBytes[peer].end(),(char*)in[peer].data());
+	}
+	return true;
+}
+
+template <typename T>
+static bool allReduceSum(Transport& transport, T& value) {
+	// Every process ends up with the sum of the values of all processes
+	int size = transport.size();
+	std::vector<std::vector<char>> out(size,std::vector<char>((char*)&value,(char*)&value + sizeof(T))), in(size,std::vector<char>(sizeof(T)));
+
+	if (!transport.exchange(out,in)) {return false;}
+	for (int peer=0;peer<size;peer++) {
+		if (peer!=transport.rank()) {value += *(T*)in[peer].data();}
+	}
+	return true;
+}
+
+class UnixSocketTransport : public Transport {
+public:
+	/* Connects nrProcesses processes on the same machine with a full mesh of Unix socket pairs. Construct it before
+	 * forking, and call becomeRank in every process after the fork
+	 */
+	explicit UnixSocketTransport(int nrProcesses) : myRank(0), nrProcesses(nrProcesses),
+			sockets(nrProcesses,std::vector<int>(nrProcesses,-1)) {
+		for (int i=0;i<nrProcesses;i++) {
+			for (int j=i+1;j<nrProcesses;j++) {
+				int pair[2];
+				if (socketpair(AF_UNIX,SOCK_STREAM,0,pair)) {
+					std::cerr << "Unable to create socket pair" << std::endl;
+					continue; // exchange fails on the missing socket
+				}
+				sockets[i][j]=pair[0]; // Used by i to talk to j
+				sockets[j][i]=pair[1];
+			}
+		}
+	}
+
+	~UnixSocketTransport() {close();}
+
+	void close() {
+		// Closes this process' ends, so the peers' exchanges fail instead of waiting for it
+		for (int peer=0;peer<nrProcesses;peer++) {
+			if (sockets[myRank][peer]>=0) {::close(sockets[myRank][peer]); sockets[myRank][peer]=-1;}
+		}
+	}
+
+	void becomeRank(int rank) {
+		// Closes the sockets that belong to the other processes
+		myRank=rank;
+		for (int i=0;i<nrProcesses;i++) {
+			if (i==rank) {continue;}
+			for (int j=0;j<nrProcesses;j++) {
+				if (sockets[i][j]>=0) {::close(sockets[i][j]); sockets[i][j]=-1;}
+			}
+		}
+		for (int peer=0;peer<nrProcesses;peer++) {
+			if (sockets[rank][peer]>=0) {fcntl(sockets[rank][peer],F_SETFL,O_NONBLOCK);}
+		}
+	}
+
+	int rank() const {return myRank;}
+	int size() const {return nrProcesses;}
+
+	bool exchange(const std::vector<std::vector<char>>& out, std::vector<std::vector<char>>& in) {
+		// Sends and receives on all sockets at once with poll, so no process blocks on a full socket buffer
+		std::vector<size_t> sent(nrProcesses,0), received(nrProcesses,0);
+
+		while (true) {
+			std::vector<pollfd> fds;
+			for (int peer=0;peer<nrProcesses;peer++) {
+				if (peer==myRank) {continue;}
+				short events = 0;
+				if (sent[peer]<out[peer].size()) {events|=POLLOUT;}
+				if (received[peer]<in[peer].size()) {events|=POLLIN;}
+				if (events==0) {continue;}
+				if (sockets[myRank][peer]<0) {return false;}
+				pollfd fd = {sockets[myRank][peer],events,0};
+				fds.push_back(fd);
+			}
+			if (fds.empty()) {return true;}
+			if (poll(fds.data(),fds.size(),-1)<0) {return false;}
+
+			for (size_t i=0;i<fds.size();i++) {
+				int peer = peerOf(fds[i].fd);
+				if (fds[i].revents & POLLOUT) {
+					// MSG_NOSIGNAL, a peer that has exited should make exchange fail, not kill the process with SIGPIPE
+					ssize_t done = send(fds[i].fd,out[peer].data()+sent[peer],out[peer].size()-sent[peer],MSG_NOSIGNAL);
+					if (done<0 && errno!=EAGAIN) {return false;}
+					if (done>0) {sent[peer]+=done;}
+				}
+				if (fds[i].revents & (POLLIN | POLLHUP)) {
+					ssize_t done = read(fds[i].fd,in[peer].data()+received[peer],in[peer].size()-received[peer]);
+					if (done==0 || (done<0 && errno!=EAGAIN)) {return false;} // The peer has exited
+					if (done>0) {received[peer]+=done;}
+				}
+				else if (fds[i].revents & (POLLERR | POLLNVAL)) {return false;}
+			}
+		}
+	}
+
+private:
+	int peerOf(int fd) const {
+		for (int peer=0;peer<nrProcesses;peer++) {
+			if (sockets[myRank][peer]==fd) {return peer;}
+		}
+		return -1;
+	}
+
+	int myRank,nrProcesses;
+	std::vector<std::vector<int>> sockets; // sockets[i][j] is the end process i uses to talk to process j
+};
+
+#endif
@@ -0,0 +1,11 @@
+#! /bin/sh -
+# A system where the LU factorization of the coarsest level has to swap rows
+printf 'a = b + 1\nb = a + c + 0\nc = b + 1\n' > eqPivot
+printf 'a = -1\nb = -2\nc = -1\n' > ansPivot
+./TCcalcJacobi eqPivot -amg | ./TCcheckPos ansPivot || exit 1
+./TCcalcJacobi eqPivot -amg -bicgstab | ./TCcheckPos ansPivot || exit 1
+i=0; while [ "$i" -lt 1000 ]; do
+  ./TCgenPos eq ans
+  ./TCcalcJacobi eq -amg -bicgstab | ./TCcheckPos ans || break
+  i=$((i + 1))
+done
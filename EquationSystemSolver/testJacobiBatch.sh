@@ -0,0 +1,13 @@
+#! /bin/sh -
+mkdir -p batch
+i=0; while [ "$i" -lt 1000 ]; do
+  ./TCgenPos batch/eq$i batch/ans$i
+  cat batch/eq$i; echo
+  i=$((i + 1))
+done > batch/all
+./TCcalcJacobi batch/all -batch | awk 'BEGIN{n=0; f="batch/out0"; printf "" > f} /^$/{close(f); n++; f="batch/out" n; printf "" > f; next} {print > f}'
+i=0; while [ "$i" -lt 1000 ]; do
+  ./TCcheckPos batch/ans$i < batch/out$i || break
+  i=$((i + 1))
+done
+rm -r batch
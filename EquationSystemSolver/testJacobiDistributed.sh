@@ -0,0 +1,11 @@
+#! /bin/sh -
+# A bad row in the first and in the last process must end all processes with an error, not leave them waiting
+printf 'a = a + b + 1\nb = 1\nc = b + 1\nd = c + 1\n' > eqBad
+timeout 10 ./TCcalcJacobi eqBad -processes 4 > /dev/null 2>&1; [ $? -eq 255 ] || exit 1
+printf 'a = b + 1\nb = 1\nc = b + 1\nd = d + c + 1\n' > eqBad
+timeout 10 ./TCcalcJacobi eqBad -processes 4 > /dev/null 2>&1; [ $? -eq 255 ] || exit 1
+i=0; while [ "$i" -lt 1000 ]; do
+  ./TCgenPos eq ans
+  ./TCcalcJacobi eq -processes 4 | ./TCcheckPos ans || break
+  i=$((i + 1))
+done
@@ -0,0 +1,26 @@
+#! /bin/sh -
+# Runs the benchmark suite against every MallocLib strategy and against the libc allocator
+# Usage: ./benchmark.sh [nrThreads [program args...]]
+# The trace workload replays the allocations of program if it is given (it is run once with MALLOCLIB_TRACE to record
+# them), and a synthetic trace otherwise
+threads=${1:-4}
+[ $# -gt 0 ] && shift
+mkdir -p build
+gcc -O2 -pthread src/Benchmark.c -o build/Benchmark || exit 1
+gcc -O2 -shared -fPIC src/MallocLib.c -o build/libMallocLib.so || exit 1
+
+if [ $# -gt 0 ]; then
+  MALLOCLIB_TRACE=build/trace LD_PRELOAD=./build/libMallocLib.so "$@" > /dev/null || exit 1
+else
+  ./build/Benchmark gentrace build/trace 200000 || exit 1
+fi
+
+for strategy in 1 2 3 4; do
+  echo "STRATEGY $strategy"
+  MALLOCLIB_STRATEGY=$strategy LD_PRELOAD=./build/libMallocLib.so ./build/Benchmark all $threads
+  MALLOCLIB_STRATEGY=$strategy LD_PRELOAD=./build/libMallocLib.so ./build/Benchmark trace build/trace $threads
+done
+
+echo "glibc"
+./build/Benchmark all $threads
+./build/Benchmark trace build/trace $threads
@@ -0,0 +1,551 @@
+/*
+ * Description:
+ *
+ * Benchmark suite for MallocLib (or any other malloc, loaded with LD_PRELOAD). Each workload runs in its own
+ * child process, so that the peak RSS reported is the workload's own. Workloads:
+ *
+ * prodcons - producer threads allocate blocks and hand them to consumer threads through a queue, the consumers
+ *            free them. Every free is a cross thread free
+ * larson   - server churn, after larson: every thread owns a set of slots and repeatedly frees a random slot and
+ *            allocates a new block of random size into it. Between rounds the slot sets are passed on to the next
+ *            thread, so blocks are freed by other threads than the ones that allocated them
+ * trace    - replays a recorded trace file. Every line is one of:
+ *                m id size    (malloc size bytes, and call the block id)
+ *                r id size    (realloc block id to size bytes)
+ *                f id         (free block id)
+ *            ids must be smaller than the number of lines in the trace. A trace of a real program is recorded by
+ *            running it with MallocLib and MALLOCLIB_TRACE=tracefile (see MallocLib.h), which logs every malloc,
+ *            realloc and free in this format
+ * realloc  - grows many buffers at the same time, either by doubling them or by adding a fixed amount, the way
+ *            vectors and string builders do
+ * large    - every thread allocates a big array of doubles, fills it and updates random elements in it, the way the
+ *            solvers use their matrices. The operations counted are the mallocs and frees like in the other
+ *            workloads, and the updates per second are printed as well. They are bound by TLB misses unless the
+ *            array is on huge pages
+ *
+ * For every workload the number of operations per second, the latency percentiles of the sampled operations,
+ * the peak RSS and the fragmentation are printed. The fragmentation is peak RSS over peak live (requested) bytes,
+ * which can be measured for any allocator. When MallocLib is loaded its own fragmentation figure is also printed
+ *
+ * Compile with:
+ * gcc -O2 -pthread Benchmark.c -o Benchmark
+ *
+ * Run with:
+ * ./Benchmark [all | prodcons | larson | realloc | large | trace tracefile | gentrace tracefile nrOps] [nrThreads]
+ *
+ * gentrace writes a synthetic trace with the size distribution of Tester.c, for when there is no recorded one
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "MallocLib.h"
+
+#define MAX_THREADS 64
+#define LATENCY_SAMPLE_RATE 16 // Time one operation out of this many
+#define MAX_LATENCY_SAMPLES (1 << 20) // Per thread
+
+#define PRODCONS_OPS 2000000 // Blocks passed from producers to consumers, in total
+#define QUEUE_SIZE 4096
+#define LARSON_SLOTS 1000 // Per thread
+#define LARSON_ROUNDS 20
+#define LARSON_OPS_PER_ROUND 50000 // Per thread
+#define REALLOC_BUFFERS 1000 // Per thread
+#define REALLOC_MAXSIZE (1 << 20)
+#define LARGE_ROUNDS 4 // Arrays allocated and freed per thread
+#define LARGE_SIZE (64 << 20) // Per array
+#define LARGE_UPDATES (1 << 22) // Per array
+#define MAXSIZE 2048 // Max size of the small blocks, in doubles like in Tester.c
+
+// Declared weak, so that the benchmark also runs against allocators that are not MallocLib
+extern void mallocLibGetStats(mallocLibStats *stats) __attribute__((weak));
+
+typedef struct threadResult {
+	long ops; // Allocator calls
+	long updates; // Array element updates, only counted by the large workload
+	long nrSamples;
+	long *samples; // Latencies in ns
+} threadResult;
+
+typedef struct workload {
+	const char *name;
+	void (*run)(int threadIndex);
+	int nrThreads;
+} workload;
+
+static int nrThreads=4;
+static int latencySampleRate=LATENCY_SAMPLE_RATE;
+static threadResult results[MAX_THREADS];
+static const char *traceFileName=NULL;
+static long liveBytes=0, peakLiveBytes=0; // Requested bytes in live blocks, over all threads
+
+static void *allocBookkeeping(size_t size) {
+	// The benchmark's own memory is mapped directly, so that it doesn't disturb the allocator being measured
+	void *mem = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+	if (mem==MAP_FAILED) {perror("mmap"); exit(-1);}
+	return mem;
+}
+
+static inline long nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return now.tv_sec*1000000000L + now.tv_nsec;
+}
+
+static inline unsigned int nextRand(unsigned int *seed) {
+	// xorshift, rand() takes a lock in glibc, which would be measured as well
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+static inline int sampleThis(threadResult *result) {
+	return result->ops % latencySampleRate == 0 && result->nrSamples < MAX_LATENCY_SAMPLES;
+}
+
+static inline void addLive(long bytes) {
+	long live = __atomic_add_fetch(&liveBytes,bytes,__ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&peakLiveBytes,__ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&peakLiveBytes,&peak,live,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+static inline void *timedMalloc(threadResult *result, size_t size) {
+	void *vPoint;
+	if (sampleThis(result)) {
+		long start = nowNs();
+		vPoint = malloc(size);
+		result->samples[result->nrSamples++] = nowNs() - start;
+	}
+	else {vPoint = malloc(size);}
+	if (size && !vPoint) {fprintf(stderr,"* ERROR: malloc returned NULL\n"); exit(-1);}
+	if (vPoint) {*(char *)vPoint = 1;} // Touch the block
+	result->ops++;
+	return vPoint;
+}
+
+static inline void *timedRealloc(threadResult *result, void *vPoint, size_t size) {
+	if (sampleThis(result)) {
+		long start = nowNs();
+		vPoint = realloc(vPoint,size);
+		result->samples[result->nrSamples++] = nowNs() - start;
+	}
+	else {vPoint = realloc(vPoint,size);}
+	if (size && !vPoint) {fprintf(stderr,"* ERROR: realloc returned NULL\n"); exit(-1);}
+	if (vPoint) {((char *)vPoint)[size-1] = 1;} // Touch the new end of the block
+	result->ops++;
+	return vPoint;
+}
+
+static inline void timedFree(threadResult *result, void *vPoint) {
+	if (sampleThis(result)) {
+		long start = nowNs();
+		free(vPoint);
+		result->samples[result->nrSamples++] = nowNs() - start;
+	}
+	else {free(vPoint);}
+	result->ops++;
+}
+
+// prodcons
+
+typedef struct queue {
+	void *blocks[QUEUE_SIZE];
+	size_t sizes[QUEUE_SIZE];
+	long head, tail, remaining; // remaining is the number of blocks still to be produced
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty, notFull;
+} queue;
+
+static queue *blockQueue;
+
+static void runProdCons(int threadIndex) {
+	threadResult *result = &results[threadIndex];
+	unsigned int seed = threadIndex*7919 + 1;
+	int producer = threadIndex % 2 == 0; // Every other thread is a producer
+	void *vPoint;
+	size_t size;
+
+	while (1) {
+		if (producer) {
+			pthread_mutex_lock(&blockQueue->lock);
+			if (blockQueue->remaining==0) {pthread_mutex_unlock(&blockQueue->lock); return;}
+			blockQueue->remaining--;
+			pthread_mutex_unlock(&blockQueue->lock);
+
+			size = nextRand(&seed) % (MAXSIZE*sizeof (double)) + 1;
+			vPoint = timedMalloc(result,size);
+			addLive(size);
+
+			pthread_mutex_lock(&blockQueue->lock);
+			while (blockQueue->tail - blockQueue->head == QUEUE_SIZE) {pthread_cond_wait(&blockQueue->notFull,&blockQueue->lock);}
+			blockQueue->blocks[blockQueue->tail % QUEUE_SIZE] = vPoint;
+			blockQueue->sizes[blockQueue->tail % QUEUE_SIZE] = size;
+			blockQueue->tail++;
+			pthread_cond_signal(&blockQueue->notEmpty);
+			pthread_mutex_unlock(&blockQueue->lock);
+		}
+		else {
+			pthread_mutex_lock(&blockQueue->lock);
+			while (blockQueue->tail == blockQueue->head) {
+				if (blockQueue->remaining==0 && blockQueue->tail == blockQueue->head) {
+					// All blocks are produced and consumed. Wake the other consumers so they can stop too
+					pthread_cond_broadcast(&blockQueue->notEmpty);
+					pthread_mutex_unlock(&blockQueue->lock);
+					return;
+				}
+				pthread_cond_wait(&blockQueue->notEmpty,&blockQueue->lock);
+			}
+			vPoint = blockQueue->blocks[blockQueue->head % QUEUE_SIZE];
+			size = blockQueue->sizes[blockQueue->head % QUEUE_SIZE];
+			blockQueue->head++;
+			pthread_cond_signal(&blockQueue->notFull);
+			pthread_mutex_unlock(&blockQueue->lock);
+
+			timedFree(result,vPoint);
+			addLive(-(long) size);
+		}
+	}
+}
+
+static void setupProdCons() {
+	blockQueue = allocBookkeeping(sizeof (queue));
+	blockQueue->remaining = PRODCONS_OPS;
+	pthread_mutex_init(&blockQueue->lock,NULL);
+	pthread_cond_init(&blockQueue->notEmpty,NULL);
+	pthread_cond_init(&blockQueue->notFull,NULL);
+}
+
+// larson
+
+typedef struct slotSet {
+	void *blocks[LARSON_SLOTS];
+	size_t sizes[LARSON_SLOTS];
+} slotSet;
+
+static slotSet *slotSets;
+static pthread_barrier_t roundBarrier;
+
+static void runLarson(int threadIndex) {
+	threadResult *result = &results[threadIndex];
+	unsigned int seed = threadIndex*104729 + 1;
+	int round, op, slot;
+
+	for (round=0;round<LARSON_ROUNDS;round++) {
+		// Work on the slots the previous thread used in the last round
+		slotSet *slots = &slotSets[(threadIndex + round) % nrThreads];
+
+		for (op=0;op<LARSON_OPS_PER_ROUND;op++) {
+			slot = nextRand(&seed) % LARSON_SLOTS;
+			if (slots->blocks[slot]) {
+				timedFree(result,slots->blocks[slot]);
+				addLive(-(long) slots->sizes[slot]);
+			}
+			// Mostly small server objects, sometimes a larger buffer
+			slots->sizes[slot] = (nextRand(&seed) % 8 == 0) ? nextRand(&seed) % 16384 + 1 : nextRand(&seed) % 256 + 1;
+			slots->blocks[slot] = timedMalloc(result,slots->sizes[slot]);
+			addLive(slots->sizes[slot]);
+		}
+		pthread_barrier_wait(&roundBarrier);
+	}
+
+	pthread_barrier_wait(&roundBarrier);
+	slotSet *slots = &slotSets[threadIndex];
+	for (slot=0;slot<LARSON_SLOTS;slot++) {
+		if (slots->blocks[slot]) {
+			timedFree(result,slots->blocks[slot]);
+			addLive(-(long) slots->sizes[slot]);
+		}
+	}
+}
+
+static void setupLarson() {
+	slotSets = allocBookkeeping(nrThreads * sizeof (slotSet));
+	pthread_barrier_init(&roundBarrier,NULL,nrThreads);
+}
+
+// trace
+
+typedef struct traceOp {
+	char type;
+	long id;
+	size_t size;
+} traceOp;
+
+static traceOp *traceOps;
+static long nrTraceOps;
+
+static void runTrace(int threadIndex) {
+	// The trace is replayed by a single thread, since the order of the operations matters
+	threadResult *result = &results[threadIndex];
+	void **blocks = allocBookkeeping(nrTraceOps * sizeof (void *));
+	size_t *sizes = allocBookkeeping(nrTraceOps * sizeof (size_t));
+	long i;
+
+	for (i=0;i<nrTraceOps;i++) {
+		traceOp *op = &traceOps[i];
+		if (op->type=='m') {
+			blocks[op->id] = timedMalloc(result,op->size);
+			sizes[op->id] = op->size;
+			addLive(op->size);
+		}
+		else if (op->type=='r') {
+			blocks[op->id] = timedRealloc(result,blocks[op->id],op->size);
+			addLive((long) op->size - (long) sizes[op->id]);
+			sizes[op->id] = op->size;
+		}
+		else {
+			timedFree(result,blocks[op->id]);
+			blocks[op->id] = NULL;
+			addLive(-(long) sizes[op->id]);
+			sizes[op->id] = 0;
+		}
+	}
+}
+
+static int setupTrace() {
+	FILE *traceFile = fopen(traceFileName,"r");
+	char line[128];
+	long capacity = 1024;
+
+	if (!traceFile) {perror(traceFileName); return -1;}
+
+	traceOps = allocBookkeeping(capacity * sizeof (traceOp));
+	nrTraceOps = 0;
+	while (fgets(line,sizeof line,traceFile)) {
+		traceOp op = {0,0,0};
+		if (sscanf(line," %c %ld %zu",&op.type,&op.id,&op.size) < 2 || (op.type!='m' && op.type!='r' && op.type!='f') || op.id<0) {
+			fprintf(stderr,"Illegal trace line: %s",line);
+			fclose(traceFile);
+			return -1;
+		}
+		if (nrTraceOps==capacity) {
+			traceOp *grown = allocBookkeeping(2 * capacity * sizeof (traceOp));
+			memcpy(grown,traceOps,capacity * sizeof (traceOp));
+			munmap(traceOps,capacity * sizeof (traceOp));
+			traceOps = grown;
+			capacity *= 2;
+		}
+		traceOps[nrTraceOps++] = op;
+	}
+	fclose(traceFile);
+	if (nrTraceOps==0) {fprintf(stderr,"Empty trace %s\n",traceFileName); return -1;}
+
+	long i;
+	for (i=0;i<nrTraceOps;i++) {
+		if (traceOps[i].id >= nrTraceOps) {fprintf(stderr,"Trace id %ld out of range\n",traceOps[i].id); return -1;}
+	}
+	return 0;
+}
+
+static int generateTrace(const char *fileName, long nrOps) {
+	// Same size distribution as Tester.c: small blocks of up to MAXSIZE doubles that are allocated, resized and freed
+	FILE *out = fopen(fileName,"w");
+	long i, nrIds = 4000, *sizes = calloc(nrIds,sizeof (long));
+	unsigned int seed = 12345;
+
+	if (!out || !sizes) {perror(fileName); return -1;}
+	for (i=0;i<nrOps;i++) {
+		long id = nextRand(&seed) % nrIds;
+		if (!sizes[id]) {
+			sizes[id] = (nextRand(&seed) % MAXSIZE + 1) * sizeof (double);
+			fprintf(out,"m %ld %ld\n",id,sizes[id]);
+		}
+		else if (nextRand(&seed) % 5 < 3) {
+			sizes[id] = (nextRand(&seed) % MAXSIZE + 1) * sizeof (double);
+			fprintf(out,"r %ld %ld\n",id,sizes[id]);
+		}
+		else {
+			fprintf(out,"f %ld\n",id);
+			sizes[id] = 0;
+		}
+	}
+	for (i=0;i<nrIds;i++) {
+		if (sizes[i]) {fprintf(out,"f %ld\n",i);}
+	}
+	free(sizes);
+	fclose(out);
+	return 0;
+}
+
+// realloc
+
+static void runRealloc(int threadIndex) {
+	threadResult *result = &results[threadIndex];
+	char **buffers = allocBookkeeping(REALLOC_BUFFERS * sizeof (char *));
+	size_t *sizes = allocBookkeeping(REALLOC_BUFFERS * sizeof (size_t));
+	unsigned int seed = threadIndex*15485863 + 1;
+	int i, growing = 1;
+
+	while (growing) {
+		growing = 0;
+		for (i=0;i<REALLOC_BUFFERS;i++) {
+			size_t newSize;
+			if (sizes[i] >= REALLOC_MAXSIZE / 16) {continue;}
+			growing = 1;
+
+			// Half of the buffers double, the other half grow by a small fixed amount (like appending to a string)
+			if (i % 2 == 0) {newSize = sizes[i] ? 2*sizes[i] : nextRand(&seed) % 64 + 1;}
+			else {newSize = sizes[i] + 64;}
+
+			buffers[i] = timedRealloc(result,buffers[i],newSize);
+			addLive((long) newSize - (long) sizes[i]);
+			sizes[i] = newSize;
+		}
+	}
+	for (i=0;i<REALLOC_BUFFERS;i++) {
+		timedFree(result,buffers[i]);
+		addLive(-(long) sizes[i]);
+	}
+}
+
+// large
+
+static void runLarge(int threadIndex) {
+	threadResult *result = &results[threadIndex];
+	unsigned int seed = threadIndex*15485863 + 1;
+	long nrElements = LARGE_SIZE / sizeof (double), i;
+	int round;
+
+	for (round=0;round<LARGE_ROUNDS;round++) {
+		double *array = timedMalloc(result,LARGE_SIZE);
+		addLive(LARGE_SIZE);
+		for (i=0;i<nrElements;i++) {array[i] = i;}
+		for (i=0;i<LARGE_UPDATES;i++) {
+			array[(nextRand(&seed) ^ (nextRand(&seed) << 15)) % nrElements] += 1;
+		}
+		result->updates += LARGE_UPDATES;
+		timedFree(result,array);
+		addLive(-LARGE_SIZE);
+	}
+}
+
+// driver
+
+static void *threadMain(void *arg) {
+	workload *work = (workload *) ((void **) arg)[0];
+	int threadIndex = (int) (long) ((void **) arg)[1];
+	work->run(threadIndex);
+	return NULL;
+}
+
+static int compareLong(const void *a, const void *b) {
+	long la = *(const long *)a, lb = *(const long *)b;
+	return (la > lb) - (la < lb);
+}
+
+static void report(const char *name, int threads, long elapsedNs) {
+	long ops=0, updates=0, nrSamples=0, i, t;
+	long *allSamples;
+	struct rusage usage;
+
+	for (t=0;t<threads;t++) {
+		ops += results[t].ops;
+		updates += results[t].updates;
+		nrSamples += results[t].nrSamples;
+	}
+	allSamples = allocBookkeeping((nrSamples+1) * sizeof (long));
+	for (t=0,i=0;t<threads;t++) {
+		memcpy(&allSamples[i],results[t].samples,results[t].nrSamples * sizeof (long));
+		i += results[t].nrSamples;
+	}
+	qsort(allSamples,nrSamples,sizeof (long),compareLong);
+
+	getrusage(RUSAGE_SELF,&usage);
+
+	printf("%-9s threads %2d ops/s %12.0f latency ns p50 %6ld p99 %7ld p99.9 %8ld max %9ld peak RSS %8ld kB",
+			name,threads,ops / (elapsedNs / 1e9),
+			nrSamples ? allSamples[nrSamples/2] : 0,
+			nrSamples ? allSamples[nrSamples*99/100] : 0,
+			nrSamples ? allSamples[nrSamples*999/1000] : 0,
+			nrSamples ? allSamples[nrSamples-1] : 0,
+			usage.ru_maxrss);
+	if (updates > 0) {printf(" updates/s %.0f",updates / (elapsedNs / 1e9));}
+	if (peakLiveBytes > 0) {printf(" RSS/live %5.2f",usage.ru_maxrss * 1024.0 / peakLiveBytes);}
+	if (mallocLibGetStats) {
+		mallocLibStats stats;
+		mallocLibGetStats(&stats);
+		printf(" MallocLib mapped %zu fragmentation %.1f%%",stats.bytesMapped,100*stats.fragmentation);
+	}
+	printf("\n");
+}
+
+static int runWorkload(workload *work) {
+	// Runs the workload in a child process, so that every workload gets its own heap and peak RSS
+	pid_t child = fork();
+	int status, t;
+
+	if (child < 0) {perror("fork"); return -1;}
+	if (child > 0) {
+		waitpid(child,&status,0);
+		return (WIFEXITED(status) && WEXITSTATUS(status)==0) ? 0 : -1;
+	}
+
+	pthread_t threads[MAX_THREADS];
+	void *args[MAX_THREADS][2];
+	long start;
+
+	if (work->run==runProdCons) {setupProdCons();}
+	else if (work->run==runLarson) {setupLarson();}
+	else if (work->run==runTrace && setupTrace()) {exit(-1);}
+	else if (work->run==runLarge) {latencySampleRate=1;} // Only a few mallocs and frees, time all of them
+
+	for (t=0;t<work->nrThreads;t++) {
+		results[t].samples = allocBookkeeping(MAX_LATENCY_SAMPLES * sizeof (long));
+	}
+
+	start = nowNs();
+	for (t=0;t<work->nrThreads;t++) {
+		args[t][0] = work;
+		args[t][1] = (void *) (long) t;
+		pthread_create(&threads[t],NULL,threadMain,args[t]);
+	}
+	for (t=0;t<work->nrThreads;t++) {pthread_join(threads[t],NULL);}
+
+	report(work->name,work->nrThreads,nowNs() - start);
+	fflush(stdout);
+	exit(0);
+}
+
+int main(int argc, char *argv[]) {
+	const char *which = (argc > 1) ? argv[1] : "all";
+	int argIndex = 2, failed = 0, i;
+
+	if (!strcmp(which,"gentrace")) {
+		if (argc < 4) {fprintf(stderr,"Usage: %s gentrace tracefile nrOps\n",argv[0]); return -1;}
+		return generateTrace(argv[2],atol(argv[3]));
+	}
+	if (!strcmp(which,"trace")) {
+		if (argc < 3) {fprintf(stderr,"No trace file provided\n"); return -1;}
+		traceFileName = argv[2];
+		argIndex = 3;
+	}
+	if (argc > argIndex) {nrThreads = atoi(argv[argIndex]);}
+	if (nrThreads < 2 || nrThreads > MAX_THREADS) {
+		fprintf(stderr,"Number of threads must be between 2 and %d\n",MAX_THREADS);
+		return -1;
+	}
+
+	workload workloads[] = {
+		{"prodcons",runProdCons,nrThreads},
+		{"larson",runLarson,nrThreads},
+		{"realloc",runRealloc,nrThreads},
+		{"large",runLarge,nrThreads},
+		{"trace",runTrace,1}
+	};
+
+	for (i=0;i<(int) (sizeof workloads / sizeof workloads[0]);i++) {
+		if (workloads[i].run==runTrace && !traceFileName) {continue;} // Only run when a trace is given
+		if (strcmp(which,"all") && strcmp(which,workloads[i].name)) {continue;}
+		if (runWorkload(&workloads[i])) {
+			fprintf(stderr,"* ERROR: workload %s failed\n",workloads[i].name);
+			failed = 1;
+		}
+	}
+	return failed ? -1 : 0;
+}
@@ -1,12 +1,56 @@
 #include <unistd.h>
 #include <stdio.h>
-#include <math.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <execinfo.h> // backtrace
+#include "MallocLib.h"
 
-#define HEADER_SIZE sizeof (struct memBlock)
-#define ALIGNMENT 8 // must be a power of 2
+/* Block layout (boundary tags):
+ *
+ *   allocated:  [ sizeAndStatus | payload ...                              ]
+ *   free:       [ sizeAndStatus | next | prev | ...unused... | footer     ]
+ *
+ * Only the size word is kept while a block is allocated. The block size is always a multiple of ALIGNMENT,
+ * so its lowest bits are free to hold the status flags. A free block additionally stores its free list links
+ * inside the (unused) payload, and a copy of its size in its last word (the footer). The PREV_FREE flag in a
+ * header tells if the block right before it is free, in which case that block's footer can be used to find its
+ * start. Coalescing in free therefore only looks at the two neighbours and is O(1)
+ */
+#define WORD_SIZE sizeof (size_t)
+#define HEADER_SIZE offsetof (struct memBlock, next)
+#define FOOTER_SIZE WORD_SIZE
+#define ALIGNMENT 16 // must be a power of 2, and at least twice WORD_SIZE. 16 is what SSE/AVX code and max_align_t expect
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
+#define MIN_BLOCK_SIZE ALIGN(sizeof (struct memBlock) + FOOTER_SIZE) // Must be able to hold the links and the footer once freed
 
+#define FREE_BIT 0x1
+#define PREV_FREE_BIT 0x2
+#define QUICK_BIT 0x4 // Block belongs to a quick list, and is never coalesced
+#define LARGE_BIT 0x8 // Block has a mapping of its own, see largeMallocUnlocked
+#define FLAG_MASK ((size_t) (ALIGNMENT-1))
+
+/* The defaults below can be overridden at startup with environment variables, read at the first allocation:
+ * MALLOCLIB_STRATEGY=n           allocation strategy, 1: first fit, 2: best fit, 3: worst fit, 4: quick fit
+ * MALLOCLIB_QUICKLISTS=n         number of quick fit lists, with classes of 8, 16, 32... bytes
+ * MALLOCLIB_SIZE_CLASSES=a,b,..  explicit quick fit class sizes in increasing order, instead of the powers of 2
+ * MALLOCLIB_TRIM_THRESHOLD=bytes give the top of the heap back to the kernel when it has this much free memory
+ *                                (0 turns trimming off)
+ * MALLOCLIB_TOP_PAD=bytes        extra memory to request each time the heap grows, and to keep when it is trimmed
+ * MALLOCLIB_LARGE_THRESHOLD=bytes requests of at least this size get a mapping of their own (0 turns it off)
+ * MALLOCLIB_HUGEPAGES=n          how large blocks are mapped, 0: normal pages, 1: transparent huge pages,
+ *                                2: explicit huge pages if the kernel has them reserved, else transparent ones
+ * MALLOCLIB_NUMA=1               place every large block on the NUMA node of the thread allocating it, with one
+ *                                arena of freed large mappings per node
+ * MALLOCLIB_ARENA_CACHE=bytes    freed large mappings to keep per arena for reuse, instead of unmapping them
+ */
 #ifndef STRATEGY
 #define STRATEGY 4
 #endif
@@ -15,249 +59,1051 @@
 #define NRQUICKLISTS 4
 #endif
 
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128*1024)
+#endif
+
+#ifndef TOP_PAD
+#define TOP_PAD 0
+#endif
+
+#ifndef LARGE_THRESHOLD
+#define LARGE_THRESHOLD (2*1024*1024)
+#endif
+
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 1
+#endif
+
+#ifndef NUMA_ARENAS
+#define NUMA_ARENAS 0
+#endif
+
+#ifndef ARENA_CACHE
+#define ARENA_CACHE (64*1024*1024)
+#endif
+
+#if NRQUICKLISTS > MALLOCLIB_MAX_QUICKLISTS
+#error "NRQUICKLISTS is larger than MALLOCLIB_MAX_QUICKLISTS"
+#endif
+
+#define PROFILE_TABLE_SIZE 1024 // Max number of distinct allocation sites recorded, must be a power of 2
+#define PROFILE_STACK_DEPTH 8 // Return addresses kept per site, so that allocations through operator new are told apart
+#define PROFILE_SIGNAL SIGUSR2
+#define TRACE_BUFFER_SIZE 65536
+#define TRACE_TABLE_INITIAL_BITS 16 // The trace table starts with 2^16 slots
+
+#define HUGE_PAGE_SIZE ((size_t) 2*1024*1024)
+#define MAX_NUMA_NODES 64 // Nodes above this share the arena of node 0
+
+// From linux/mman.h and numaif.h, which aren't always installed
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
 
 typedef struct memBlock {
-	int free;
-	size_t size;
-    struct memBlock* next;
-    struct memBlock* prev;
+	size_t sizeAndStatus; // Size of the whole block (header included), status flags in the lowest bits
+	struct memBlock* next; // Free list links, only valid while the block is free
+	struct memBlock* prev;
 } memBlock;
 
 
-static memBlock *listStart=NULL; // Points to the first block of the list
-static memBlock *listStop=NULL; // Points to the last block of the list
-static int maxBlockSizeQuickFit=0;
+static memBlock *freeListStart=NULL; // Points to the first free block (strategy 1-3, and strategy 4 for large blocks)
+static memBlock *heapEnd=NULL; // Points to the epilogue, a zero sized allocated header marking the end of the heap
+static memBlock *quickLists[MALLOCLIB_MAX_QUICKLISTS]; // Singly linked lists of free blocks of the quick fit size classes
+static char *heapHighWater=NULL; // Highest break the heap has had. Memory above it has never been used, so it is still zero
+static volatile char heapLock=0; // All entry points take this lock, so the library can be used by threaded programs
+static int heapInitialized=0;
+
+// Tunables, set once by readTunables
+static struct memBlock* (*findFit)(size_t size); // First, best or worst fit
+static int nrQuickLists=0; // 0 unless the quick fit strategy is used
+static size_t quickListMaxRequest[MALLOCLIB_MAX_QUICKLISTS]; // Largest request served by each quick list
+static size_t trimThreshold=TRIM_THRESHOLD;
+static size_t topPad=TOP_PAD;
+
+/* Large blocks (requests of at least largeThreshold bytes) don't come from the heap but get an anonymous mapping of
+ * their own, aligned to a huge page boundary and backed by huge pages where possible, so that big arrays cost far
+ * fewer TLB entries. The block is placed at the start of the mapping with a largeHeader in front of its header, and
+ * its size covers the rest of the mapping, so malloc_usable_size and realloc work as for any other block:
+ *
+ *   [ largeHeader | sizeAndStatus (LARGE_BIT) | payload ...                      ]
+ *   ^ mapping, huge page aligned
+ *
+ * Freed large mappings are kept in the arena of the node they are on, up to arenaCache bytes, and reused by later
+ * large blocks allocated on that node
+ */
+typedef struct largeHeader {
+	char *mapping;
+	size_t mappingSize;
+	int node; // The arena the mapping goes back to
+	int hugePages; // Explicit huge pages, the size is a multiple of HUGE_PAGE_SIZE
+} largeHeader;
+
+typedef struct arenaMapping {
+	// Written at the start of a freed large mapping, while it waits in an arena
+	struct arenaMapping *next;
+	size_t mappingSize;
+	int hugePages;
+} arenaMapping;
+
+static arenaMapping *arenas[MAX_NUMA_NODES];
+static size_t arenaBytes[MAX_NUMA_NODES];
+static size_t largeThreshold=LARGE_THRESHOLD;
+static int hugePages=HUGE_PAGES;
+static int numaArenas=NUMA_ARENAS;
+static size_t arenaCache=ARENA_CACHE;
+static int largeReused=0; // Set when the last large block got a reused mapping, which isn't zeroed like a fresh one
+
+typedef struct profileEntry {
+	void *stack[PROFILE_STACK_DEPTH]; // Return address of the allocation call and of its callers, NULL padded
+	size_t samples, bytes;
+	size_t estimatedBytes; // Each sample stands for profileInterval bytes, or for itself if it is larger
+} profileEntry;
+
+static mallocLibStats stats; // Counters, the fields that need a free list scan are only filled in by mallocLibGetStats
+static int dumpStatsAtExit=0;
+static long profileInterval=0; // Sample an allocation every profileInterval bytes, 0 if profiling is off
+static volatile sig_atomic_t dumpRequested=0; // Set by PROFILE_SIGNAL, the dump is done by the next malloc or free
+static long bytesUntilSample=0;
+static profileEntry profileTable[PROFILE_TABLE_SIZE];
+static int stackWalkReady=0; // 0 until the first sample, 1 while it loads the unwinder, 2 once backtrace can be used
+
+typedef struct traceEntry {
+	void *block; // Payload of a live block, NULL for an empty slot
+	long id;
+} traceEntry;
 
-memBlock* extendHeap(size_t dataSize) {
+// Trace recording (MALLOCLIB_TRACE), in the format Benchmark.c replays
+static int traceFd=-1;
+static pid_t tracePid; // A forked child stops recording, so that it doesn't write the parent's lines again
+static char traceBuffer[TRACE_BUFFER_SIZE];
+static size_t traceUsed=0;
+static long nextTraceId=0;
+static traceEntry *traceTable=NULL; // Open addressed, from block to id. Mapped directly, so it never calls malloc
+static size_t traceTableSize=0,traceTableUsed=0;
+static int traceTableBits=0;
+
+static inline void lockHeap() {
+	while (__atomic_test_and_set(&heapLock,__ATOMIC_ACQUIRE)) {sched_yield();}
+}
+
+static inline void unlockHeap() {
+	__atomic_clear(&heapLock,__ATOMIC_RELEASE);
+}
+
+static inline size_t blockSize(memBlock *block) {return block->sizeAndStatus & ~FLAG_MASK;}
+static inline int isFree(memBlock *block) {return block->sizeAndStatus & FREE_BIT;}
+static inline int isPrevFree(memBlock *block) {return block->sizeAndStatus & PREV_FREE_BIT;}
+static inline memBlock* nextBlock(memBlock *block) {return (memBlock *) ((char *)block + blockSize(block));}
+static inline void* payloadOf(memBlock *block) {return (char *)block + HEADER_SIZE;}
+static inline memBlock* blockOf(void *vPoint) {return (memBlock *) ((char *)vPoint - HEADER_SIZE);}
+
+static inline memBlock* prevBlock(memBlock *block) {
+	// Only valid if isPrevFree(block), since only free blocks have a footer
+	size_t prevSize = *((size_t *)block - 1);
+	return (memBlock *) ((char *)block - prevSize);
+}
+
+static inline void setFooter(memBlock *block) {
+	*(size_t *) ((char *)nextBlock(block) - FOOTER_SIZE) = blockSize(block);
+}
+
+static inline size_t requestToBlockSize(size_t dataSize) {
+	size_t size = ALIGN(dataSize+HEADER_SIZE);
+	return (size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : size;
+}
+
+static inline size_t quickListBlockSize(int i) {
+	// Quick list blocks never enter the free list, so they need no room for links
+	return ALIGN(HEADER_SIZE + quickListMaxRequest[i]);
+}
+
+static void insertFree(memBlock *block) {
+	// Push the block on the front of the free list, the list is not address ordered since coalescing doesn't need it
+	setFooter(block);
+	block->prev=NULL;
+	block->next=freeListStart;
+	if (freeListStart) {freeListStart->prev=block;}
+	freeListStart=block;
+	stats.freeListLength++;
+}
+
+static void unlinkFree(memBlock *block) {
+	if (block->prev) {block->prev->next=block->next;}
+	else {freeListStart=block->next;}
+	if (block->next) {block->next->prev=block->prev;}
+	stats.freeListLength--;
+}
+
+static memBlock* extendHeap(size_t size) {
+	/* Grows the heap by a free block of (at least) size bytes and returns it unlinked, without a footer. If the
+	 * break is where the heap ended, the old epilogue becomes the new block's header and a free block at the end
+	 * of the heap is merged with it, so only the missing part has to be requested. Otherwise (first call, or
+	 * someone else moved the break) a new segment is started and the old epilogue stays as a fence
+	 */
 	memBlock *newBlock;
+	char *brk = sbrk(0);
+	size_t pad=0, request;
+	int contiguous = heapEnd && brk == (char *)heapEnd + HEADER_SIZE;
+
+	if (contiguous && isPrevFree(heapEnd)) {size -= blockSize(prevBlock(heapEnd));}
+	if (size > (size_t) INTPTR_MAX - ALIGN(topPad) - ALIGNMENT - HEADER_SIZE) {errno = ENOMEM; return NULL;}
+	size += ALIGN(topPad);
+
+	if (contiguous) {request = size;}
+	else {
+		pad = (ALIGNMENT - ((size_t)brk + HEADER_SIZE) % ALIGNMENT) % ALIGNMENT; // Payloads must be aligned
+		request = pad + size + HEADER_SIZE; // Room for the new segment's epilogue
+	}
 
-//	newBlock = (memBlock *) mmap(0, dataSize+HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	newBlock = sbrk(dataSize+HEADER_SIZE);
-	if (newBlock==(void *) -1) {
-		// mmap fail
-		perror("mmap fail\n");
+	// sbrk takes a signed increment, a larger request would shrink the heap under the blocks in use
+	if (request > (size_t) INTPTR_MAX) {errno = ENOMEM; return NULL;}
+	if (sbrk(request)==(void *) -1) {
+		// perror is avoided here, since it may call malloc and the heap lock is held
+		static const char message[] = "sbrk fail\n";
+		write(STDERR_FILENO,message,sizeof message - 1);
 		return NULL;
 	}
+	if (brk + request > heapHighWater) {heapHighWater = brk + request;}
+	stats.bytesMapped += request;
 
-	newBlock->free = 0;
-	newBlock->next = NULL;
-	newBlock->prev = NULL;
-	newBlock->size = dataSize;
+	if (contiguous) {
+		newBlock = heapEnd;
+		newBlock->sizeAndStatus = size | FREE_BIT | (heapEnd->sizeAndStatus & PREV_FREE_BIT);
+	}
+	else {
+		newBlock = (memBlock *) (brk + pad);
+		newBlock->sizeAndStatus = size | FREE_BIT;
+	}
 
-	if (STRATEGY==4) {return newBlock;}	// Use quicklists, dont link here
+	heapEnd = nextBlock(newBlock);
+	heapEnd->sizeAndStatus = 0 | PREV_FREE_BIT;
 
-	if(!listStop) {newBlock->prev=NULL;} // First call
-	else {
-		newBlock->prev=listStop;
-		listStop->next=newBlock;
+	if (isPrevFree(newBlock)) {
+		// The last block of the heap was free, merge it with the new memory
+		memBlock *prev = prevBlock(newBlock);
+		unlinkFree(prev);
+		prev->sizeAndStatus += size;
+		newBlock = prev;
 	}
 
-	listStop=newBlock;
 	return newBlock;
 }
 
-memBlock* bestFit(size_t dataSize) {
+static int callerNode() {
+	// The arena of the calling thread: the NUMA node of the CPU it runs on, or 0 if the arenas are off
+	unsigned cpu, node;
+	if (!numaArenas || syscall(SYS_getcpu,&cpu,&node,NULL)!=0 || node >= MAX_NUMA_NODES) {return 0;}
+	return node;
+}
+
+static char* mapLarge(size_t size, int node, size_t *mappingSize, int *explicitHuge) {
+	/* Maps at least size bytes (a multiple of the page size), aligned to a huge page. Explicit huge pages are only
+	 * there if the administrator reserved them (vm.nr_hugepages), otherwise the mapping is over allocated by a huge
+	 * page, trimmed to the alignment and marked for transparent huge pages
+	 */
+	char *mapping = MAP_FAILED;
+	*explicitHuge = 0;
+
+	if (hugePages==2) {
+		*mappingSize = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		mapping = mmap(NULL,*mappingSize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,-1,0);
+		*explicitHuge = (mapping!=MAP_FAILED);
+	}
+	if (mapping==MAP_FAILED && hugePages) {
+		size_t rawSize = size + HUGE_PAGE_SIZE;
+		char *raw = mmap(NULL,rawSize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+		if (raw==MAP_FAILED) {return NULL;}
+		mapping = (char *) (((size_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+		if (mapping > raw) {munmap(raw,mapping - raw);}
+		if (raw + rawSize > mapping + size) {munmap(mapping + size,raw + rawSize - (mapping + size));}
+		*mappingSize = size;
+		madvise(mapping,size,MADV_HUGEPAGE); // Only a hint, fails harmlessly if transparent huge pages are off
+	}
+	if (mapping==MAP_FAILED) {
+		*mappingSize = size;
+		mapping = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+		if (mapping==MAP_FAILED) {return NULL;}
+	}
+
+	if (numaArenas) {
+		// Prefer the node, but take memory from the others rather than fail. The pages are placed when first touched
+		unsigned long nodeMask = 1UL << node;
+		syscall(SYS_mbind,mapping,*mappingSize,MPOL_PREFERRED,&nodeMask,8*sizeof nodeMask + 1,0);
+	}
+	stats.bytesMapped += *mappingSize;
+	if (*explicitHuge) {stats.hugePageMappings++;}
+	return mapping;
+}
+
+static void* largeMallocUnlocked(size_t alignment, size_t dataSize) {
+	// alignment is a power of 2, at least ALIGNMENT
+	size_t pageSize = sysconf(_SC_PAGESIZE), mappingSize=0;
+	// The mapping size, and the huge page padding of mapLarge, must not overflow
+	if (dataSize > ((size_t) -1) - (sizeof (largeHeader) + HEADER_SIZE + alignment + pageSize + HUGE_PAGE_SIZE)) {errno = ENOMEM; return NULL;}
+	size_t size = (sizeof (largeHeader) + HEADER_SIZE + alignment + dataSize + pageSize - 1) & ~(pageSize - 1);
+	int node = callerNode(), explicitHuge=0;
+	arenaMapping **bestLink=NULL, **link;
+	char *mapping;
+
+	// The smallest mapping in the arena that fits, if it isn't more than twice too large
+	for (link=&arenas[node];*link;link=&(*link)->next) {
+		size_t cachedSize = (*link)->mappingSize;
+		if (cachedSize >= size && cachedSize/2 <= size && (!bestLink || cachedSize < (*bestLink)->mappingSize)) {bestLink=link;}
+		if (cachedSize == size) {break;} // Buffers of the same size are the common case, no need to look further
+	}
+	largeReused = (bestLink!=NULL);
+	if (bestLink) {
+		arenaMapping *cached = *bestLink;
+		*bestLink = cached->next;
+		mapping = (char *)cached;
+		mappingSize = cached->mappingSize;
+		explicitHuge = cached->hugePages;
+		arenaBytes[node] -= mappingSize;
+		stats.bytesInArenas -= mappingSize;
+	}
+	else {
+		mapping = mapLarge(size,node,&mappingSize,&explicitHuge);
+		if (!mapping) {return NULL;}
+	}
+
+	char *payload = (char *) (((size_t)mapping + sizeof (largeHeader) + HEADER_SIZE + alignment - 1) & ~(alignment - 1));
+	memBlock *block = blockOf(payload);
+	largeHeader *header = (largeHeader *)block - 1;
+	header->mapping = mapping;
+	header->mappingSize = mappingSize;
+	header->node = node;
+	header->hugePages = explicitHuge;
+	block->sizeAndStatus = ((size_t) (mapping + mappingSize - (char *)block) & ~FLAG_MASK) | LARGE_BIT;
+
+	stats.bytesInUse += blockSize(block);
+	stats.largeBlocks++;
+	return payload;
+}
+
+static void freeLarge(memBlock *block) {
+	// Keeps the mapping in its arena if there is room, otherwise unmaps it
+	largeHeader *header = (largeHeader *)block - 1;
+	char *mapping = header->mapping;
+	size_t mappingSize = header->mappingSize;
+	int node = header->node, explicitHuge = header->hugePages;
+
+	stats.largeBlocks--;
+	if (arenaBytes[node] + mappingSize <= arenaCache) {
+		arenaMapping *cached = (arenaMapping *)mapping;
+		cached->mappingSize = mappingSize;
+		cached->hugePages = explicitHuge;
+		cached->next = arenas[node];
+		arenas[node] = cached;
+		arenaBytes[node] += mappingSize;
+		stats.bytesInArenas += mappingSize;
+		return;
+	}
+	munmap(mapping,mappingSize);
+	stats.bytesMapped -= mappingSize;
+	if (explicitHuge) {stats.hugePageMappings--;}
+}
+
+static memBlock* bestFit(size_t size) {
 	memBlock *currentBlock, *returnBlock=NULL;
-	currentBlock = listStart;
 
-	int smallestBlockSize=-1;
-	while(1) {
-		if(currentBlock->free && currentBlock->size >= dataSize && (smallestBlockSize==-1 || smallestBlockSize>currentBlock->size)) {
-			smallestBlockSize=currentBlock->size;
+	for (currentBlock=freeListStart;currentBlock;currentBlock=currentBlock->next) {
+		if(blockSize(currentBlock) >= size && (!returnBlock || blockSize(returnBlock)>blockSize(currentBlock))) {
 			returnBlock=currentBlock;
+			if (blockSize(returnBlock)==size) {break;} // Can't get any better
 		}
-		if (currentBlock->next==NULL) {break;}
-		currentBlock=currentBlock->next;
 	}
-
-	if (returnBlock!=0) {returnBlock->free=0;}
 	return returnBlock;
 }
 
-memBlock* worstFit(size_t dataSize) {
+static memBlock* worstFit(size_t size) {
 	memBlock *currentBlock, *returnBlock=NULL;
-	currentBlock = listStart;
 
-	int biggestBlockSize=-1;
-	while(1) {
-		if(currentBlock->free && currentBlock->size >= dataSize && (biggestBlockSize==-1 || biggestBlockSize<currentBlock->size)) {
-			biggestBlockSize=currentBlock->size;
+	for (currentBlock=freeListStart;currentBlock;currentBlock=currentBlock->next) {
+		if(blockSize(currentBlock) >= size && (!returnBlock || blockSize(returnBlock)<blockSize(currentBlock))) {
 			returnBlock=currentBlock;
 		}
-		if (currentBlock->next==NULL) {break;}
-		currentBlock=currentBlock->next;
 	}
-
-	if (returnBlock!=0) {returnBlock->free=0;}
 	return returnBlock;
 }
 
-memBlock* firstFit(size_t dataSize) {
+static memBlock* firstFit(size_t size) {
 	memBlock *currentBlock;
-	currentBlock = listStart;
-	while(1) {
-		if(currentBlock->free && currentBlock->size >= dataSize) {
-			currentBlock->free=0;
-			return currentBlock;
-		}
-		if (currentBlock->next==NULL) {return NULL;}
-		currentBlock=currentBlock->next;
+
+	for (currentBlock=freeListStart;currentBlock;currentBlock=currentBlock->next) {
+		if(blockSize(currentBlock) >= size) {return currentBlock;}
 	}
+	return NULL;
 }
 
-int areBlocksContiguous (memBlock *leftBlock, memBlock *rightBlock) {
-	// return 1 if left block is contiguous with right block. If false, there is an unmapped partial page in between
-	if (rightBlock == (memBlock *) ( (void *)leftBlock + HEADER_SIZE + leftBlock->size)) {return 1;}
-	else {return 0;}
+static void* allocateBlock(memBlock *block, size_t size) {
+	// Marks an unlinked free block as allocated, and splits off the rest of it if it is big enough to be a block on its own
+	size_t totalSize = blockSize(block);
+
+	if (totalSize - size >= MIN_BLOCK_SIZE) {
+		memBlock *restBlock;
+
+		block->sizeAndStatus = size | (block->sizeAndStatus & PREV_FREE_BIT);
+		restBlock = nextBlock(block);
+		restBlock->sizeAndStatus = (totalSize - size) | FREE_BIT;
+		insertFree(restBlock); // The block after restBlock already has PREV_FREE set, since block was free
+	}
+	else {
+		block->sizeAndStatus &= ~FREE_BIT;
+		nextBlock(block)->sizeAndStatus &= ~PREV_FREE_BIT;
+	}
+
+	stats.bytesInUse += blockSize(block);
+	return payloadOf(block);
 }
 
-void free(void * vPoint) {
+static int quickListIndex(size_t size) {
+	// Returns the quick list a block of the given size belongs to
+	int i;
+	for (i=nrQuickLists-1;i>0;i--) {
+		if (size >= quickListBlockSize(i)) {break;}
+	}
+	return i;
+}
+
+static void trimHeap(memBlock *lastBlock) {
+	/* Gives the end of the free, unlinked, last block of the heap back to the kernel, keeping topPad bytes. Only
+	 * whole pages are released, and only if nobody else has moved the break since the heap last grew
+	 */
+	size_t pageSize = sysconf(_SC_PAGESIZE), release;
+	char *brk = sbrk(0);
+
+	if (brk != (char *)heapEnd + HEADER_SIZE) {return;}
+	if (blockSize(lastBlock) < MIN_BLOCK_SIZE + ALIGN(topPad)) {return;}
+
+	release = (blockSize(lastBlock) - MIN_BLOCK_SIZE - ALIGN(topPad)) & ~(pageSize - 1);
+	if (release==0 || sbrk(-(long) release)==(void *) -1) {return;}
+
+	lastBlock->sizeAndStatus -= release;
+	heapEnd = nextBlock(lastBlock);
+	heapEnd->sizeAndStatus = 0 | PREV_FREE_BIT;
+	stats.bytesMapped -= release;
+}
+
+static void freeUnlocked(void * vPoint) {
 	if (vPoint==0) {return;}
-	memBlock *freeBlock = (memBlock *) (vPoint - HEADER_SIZE);
-	freeBlock->free=1;
+	memBlock *freeBlock = blockOf(vPoint), *next;
+	size_t size = blockSize(freeBlock);
+	int i;
+
+	stats.nrFrees++;
+	stats.nrAllocated--;
+	stats.bytesInUse -= size;
 
-	if (STRATEGY==4) {return;}
+	if (freeBlock->sizeAndStatus & LARGE_BIT) {
+		freeLarge(freeBlock);
+		return;
+	}
+	if (freeBlock->sizeAndStatus & QUICK_BIT) {
+		// Quick list blocks stay marked as allocated, so they are never coalesced
+		i = quickListIndex(size);
+		freeBlock->next = quickLists[i];
+		quickLists[i] = freeBlock;
+		stats.quickListLength[i]++;
+		stats.bytesInQuickLists += size;
+		return;
+	}
 
-	if (freeBlock->next && freeBlock->next->free && areBlocksContiguous(freeBlock,freeBlock->next)) {
+	next = nextBlock(freeBlock);
+	if (isFree(next)) {
 		// Next block is also free
-		freeBlock->size += (HEADER_SIZE + freeBlock->next->size);
+		unlinkFree(next);
+		size += blockSize(next);
+	}
+	if (isPrevFree(freeBlock)) {
+		// Prev block is also free
+		freeBlock = prevBlock(freeBlock);
+		unlinkFree(freeBlock);
+		size += blockSize(freeBlock);
+	}
 
-		if (freeBlock->next->next) {
-			freeBlock->next->next->prev = freeBlock;
-			freeBlock->next = freeBlock->next->next;
-		}
-		else {
-			listStop=freeBlock;
-			freeBlock->next=NULL;
+	freeBlock->sizeAndStatus = size | FREE_BIT | (freeBlock->sizeAndStatus & PREV_FREE_BIT);
+	nextBlock(freeBlock)->sizeAndStatus |= PREV_FREE_BIT;
+	if (nextBlock(freeBlock)==heapEnd && trimThreshold && size > trimThreshold + topPad) {trimHeap(freeBlock);}
+	insertFree(freeBlock);
+}
+
+static memBlock* getFreeBlock(size_t size) {
+	// Returns an unlinked free block of at least size bytes, from the free list or by growing the heap
+	memBlock *reqBlock=NULL;
+
+	reqBlock=findFit(size);
+	if (reqBlock) {unlinkFree(reqBlock);}
+	else {reqBlock = extendHeap(size);} // No space in list, allocate
+	return reqBlock;
+}
+
+static void writeString(int fd, const char *str) {
+	size_t len = strlen(str);
+	while (len > 0) {
+		ssize_t written = write(fd,str,len);
+		if (written <= 0) {return;}
+		str += written;
+		len -= written;
+	}
+}
+
+void mallocLibDumpProfile(int fd) {
+	// Does not take the heap lock, so the counts may be slightly off if other threads allocate meanwhile
+	char line[128 + 20*PROFILE_STACK_DEPTH];
+	int i,j;
+
+	if (!profileInterval) {
+		writeString(fd,"MallocLib: profiling is off, set MALLOCLIB_PROFILE\n");
+		return;
+	}
+	snprintf(line,sizeof line,"MallocLib profile, one sample per %ld bytes\n",profileInterval);
+	writeString(fd,line);
+	for (i=0;i<PROFILE_TABLE_SIZE;i++) {
+		size_t length=0;
+		if (!profileTable[i].stack[0]) {continue;}
+		length += snprintf(line,sizeof line,"site");
+		for (j=0;j<PROFILE_STACK_DEPTH && profileTable[i].stack[j];j++) {
+			length += snprintf(line + length,sizeof line - length," %p",profileTable[i].stack[j]);
 		}
+		snprintf(line + length,sizeof line - length," samples %zu bytes %zu estimated bytes %zu\n",
+				profileTable[i].samples,profileTable[i].bytes,profileTable[i].estimatedBytes);
+		writeString(fd,line);
 	}
-	if(freeBlock->prev && freeBlock->prev->free && areBlocksContiguous(freeBlock->prev,freeBlock)) {
-		// Prev block is also free
-		freeBlock = freeBlock->prev;
-		freeBlock->size += (HEADER_SIZE + freeBlock->next->size);
+}
+
+static void writeStats(int fd, mallocLibStats *s, int haveFreeListScan) {
+	char line[160];
+	int i;
+
+	snprintf(line,sizeof line,"MallocLib: mapped %zu in use %zu free %zu in quick lists %zu\n",s->bytesMapped,
+			s->bytesInUse,s->bytesFree,s->bytesInQuickLists);
+	writeString(fd,line);
+	if (haveFreeListScan) {
+		snprintf(line,sizeof line,"largest free block %zu fragmentation %d.%d%%\n",s->largestFreeBlock,
+				(int) (s->fragmentation*100),(int) (s->fragmentation*1000) % 10);
+		writeString(fd,line);
+	}
+	snprintf(line,sizeof line,"mallocs %zu frees %zu allocated blocks %zu free list length %zu\n",s->nrMallocs,
+			s->nrFrees,s->nrAllocated,s->freeListLength);
+	writeString(fd,line);
+	snprintf(line,sizeof line,"large blocks %zu explicit huge page mappings %zu in arenas %zu\n",s->largeBlocks,
+			s->hugePageMappings,s->bytesInArenas);
+	writeString(fd,line);
+	for (i=0;i<s->nrQuickLists;i++) {
+		snprintf(line,sizeof line,"quick list %d (block size %zu) length %zu\n",i,quickListBlockSize(i),s->quickListLength[i]);
+		writeString(fd,line);
+	}
+	for (i=0;i<MALLOCLIB_NR_SIZE_CLASSES;i++) {
+		if (!s->allocCount[i]) {continue;}
+		snprintf(line,sizeof line,"size class <= %zu allocations %zu\n",(size_t) 1 << i,s->allocCount[i]);
+		writeString(fd,line);
+	}
+}
+
+static void fillFreeListStats(mallocLibStats *s) {
+	// Must be called with the heap lock held
+	memBlock *currentBlock;
+
+	s->bytesFree=0;
+	s->largestFreeBlock=0;
+	for (currentBlock=freeListStart;currentBlock;currentBlock=currentBlock->next) {
+		s->bytesFree += blockSize(currentBlock);
+		if (blockSize(currentBlock) > s->largestFreeBlock) {s->largestFreeBlock = blockSize(currentBlock);}
+	}
+	s->fragmentation = s->bytesFree ? 1 - (double) s->largestFreeBlock / s->bytesFree : 0;
+}
+
+void mallocLibGetStats(mallocLibStats *s) {
+	lockHeap();
+	*s = stats;
+	fillFreeListStats(s);
+	unlockHeap();
+}
+
+void mallocLibDumpStats(int fd) {
+	mallocLibStats s;
+	mallocLibGetStats(&s);
+	writeStats(fd,&s,1);
+}
+
+static void flushTrace() {
+	if (traceFd<0) {return;}
+	if (getpid()!=tracePid) {traceFd=-1; return;}
+	char *pos = traceBuffer;
+	while (traceUsed > 0) {
+		ssize_t written = write(traceFd,pos,traceUsed);
+		if (written <= 0) {traceFd=-1; return;}
+		pos += written;
+		traceUsed -= written;
+	}
+}
+
+static void traceLine(char type, long id, size_t size, int withSize) {
+	// Appends "type id size" to the trace buffer, without snprintf, which could allocate
+	char digits[24], *pos = traceBuffer + traceUsed;
+	int n;
+
+	if (traceUsed + 64 > TRACE_BUFFER_SIZE) {flushTrace(); pos = traceBuffer;}
+	*pos++ = type;
+	for (n=0;n==0 || id;id/=10) {digits[n++] = '0' + id%10;}
+	*pos++ = ' ';
+	while (n) {*pos++ = digits[--n];}
+	if (withSize) {
+		for (n=0;n==0 || size;size/=10) {digits[n++] = '0' + size%10;}
+		*pos++ = ' ';
+		while (n) {*pos++ = digits[--n];}
+	}
+	*pos++ = '\n';
+	traceUsed = pos - traceBuffer;
+}
+
+static inline size_t traceSlot(void *block) {
+	// The top bits of a multiplicative hash, the low bits of the addresses are mostly zero
+	return (size_t) (((unsigned long long) (size_t) block * 0x9E3779B97F4A7C15ull) >> (64 - traceTableBits));
+}
+
+static int traceInsert(void *block, long id) {
+	// Returns 0 if the table could not grow
+	size_t i;
 
-		if (freeBlock->next->next) {
-			freeBlock->next->next->prev = freeBlock;
-			freeBlock->next = freeBlock->next->next;
+	if (2*(traceTableUsed+1) > traceTableSize) {
+		traceEntry *old = traceTable;
+		size_t oldSize = traceTableSize;
+		int newBits = oldSize ? traceTableBits+1 : TRACE_TABLE_INITIAL_BITS;
+		traceEntry *grown = mmap(NULL,((size_t) 1 << newBits) * sizeof (traceEntry),PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+
+		if (grown==MAP_FAILED) {return 0;}
+		traceTable = grown;
+		traceTableBits = newBits;
+		traceTableSize = (size_t) 1 << newBits;
+		traceTableUsed = 0;
+		for (i=0;i<oldSize;i++) {
+			if (old[i].block) {traceInsert(old[i].block,old[i].id);}
 		}
-		else {
-			listStop=freeBlock;
-			freeBlock->next=NULL;
+		if (old) {munmap(old,oldSize * sizeof (traceEntry));}
+	}
+	for (i=traceSlot(block);traceTable[i].block;i=(i+1) & (traceTableSize-1));
+	traceTable[i].block = block;
+	traceTable[i].id = id;
+	traceTableUsed++;
+	return 1;
+}
+
+static long traceRemove(void *block) {
+	// Returns the id of block and removes it, or -1 if it isn't in the table
+	size_t i,j,home;
+	long id;
+
+	if (!traceTableSize) {return -1;}
+	for (i=traceSlot(block);traceTable[i].block!=block;i=(i+1) & (traceTableSize-1)) {
+		if (!traceTable[i].block) {return -1;}
+	}
+	id = traceTable[i].id;
+
+	// Move back the entries after it that would no longer be found across the hole (linear probing deletion)
+	for (j=(i+1) & (traceTableSize-1);traceTable[j].block;j=(j+1) & (traceTableSize-1)) {
+		home = traceSlot(traceTable[j].block);
+		if (((j-home) & (traceTableSize-1)) >= ((j-i) & (traceTableSize-1))) {
+			traceTable[i] = traceTable[j];
+			i = j;
 		}
 	}
+	traceTable[i].block = NULL;
+	traceTableUsed--;
+	return id;
+}
 
+static void traceMalloc(void *block, size_t size) {
+	// The ids are numbered in the order of the m lines, so they are always smaller than the number of lines
+	if (traceFd<0 || !block) {return;}
+	if (!traceInsert(block,nextTraceId)) {traceFd=-1; return;}
+	traceLine('m',nextTraceId++,size,1);
 }
 
-void splitBlock(memBlock * splitBlock, size_t dataSize) {
-	// Split the block
-	memBlock* newBlock = (memBlock *) ( (void*)splitBlock + HEADER_SIZE + dataSize );
+static void traceRealloc(void *oldBlock, void *block, size_t size) {
+	long id;
 
-	newBlock->free=1;
+	if (traceFd<0 || !block) {return;}
+	id = traceRemove(oldBlock);
+	if (id<0) {traceMalloc(block,size); return;} // Allocated before the trace was opened
+	traceInsert(block,id); // Can't fail, it just got room from the block that was removed
+	traceLine('r',id,size,1);
+}
 
-	newBlock->size=splitBlock->size - dataSize - HEADER_SIZE;
-	splitBlock->size = dataSize;
+static void traceFree(void *block) {
+	long id;
 
-	// Link the new block
-	if (splitBlock->next) {splitBlock->next->prev=newBlock;}
-	else {listStop = newBlock;}
-	newBlock->next=splitBlock->next;
-	splitBlock->next = newBlock;
-	newBlock->prev = splitBlock;
+	if (traceFd<0 || !block) {return;}
+	id = traceRemove(block);
+	if (id>=0) {traceLine('f',id,0,0);}
+}
 
-	free((void *) newBlock + HEADER_SIZE);
+static void profileSignalHandler(int sig) {
+	/* Only sets a flag. Formatting the dump (snprintf) is not async-signal-safe, and the interrupted code may be in the
+	 * middle of changing the heap, so the dump is done by the next entry to the allocator instead
+	 */
+	(void) sig;
+	dumpRequested=1;
 }
 
-void *malloc(size_t dataSize) {
-	if (dataSize==0) {return (void*) 0;}
-	memBlock *reqBlock;
+static void dumpIfRequested() {
+	// Called by the entry points after they have released the heap lock
+	if (!dumpRequested) {return;}
+	dumpRequested=0;
+	mallocLibDumpStats(STDERR_FILENO);
+	mallocLibDumpProfile(STDERR_FILENO);
+}
 
-	if (STRATEGY==4 && !listStart) {
-		// Lists are not initalized, initalize
-		maxBlockSizeQuickFit = 8*pow(2,NRQUICKLISTS);
+__attribute__((destructor)) static void dumpAtExit() {
+	if (dumpStatsAtExit) {mallocLibDumpStats(STDERR_FILENO);}
+	if (profileInterval) {mallocLibDumpProfile(STDERR_FILENO);}
+	lockHeap();
+	flushTrace();
+	unlockHeap();
+}
 
-		reqBlock = extendHeap(0);
-		listStart = reqBlock;
+static size_t readSizeTunable(const char *name, size_t defaultValue) {
+	char *env = getenv(name), *end;
+	unsigned long value;
 
-		int i;
-		for (i=1;i<NRQUICKLISTS;i++) {reqBlock = extendHeap(0);} // Add first entries to all lists
+	if (!env || !*env) {return defaultValue;}
+	value = strtoul(env,&end,10);
+	if (*end) {
+		writeString(STDERR_FILENO,"MallocLib: ignoring illegal value of ");
+		writeString(STDERR_FILENO,name);
+		writeString(STDERR_FILENO,"\n");
+		return defaultValue;
 	}
+	return value;
+}
 
-	if (STRATEGY==4 && dataSize <=maxBlockSizeQuickFit) {
-		// Which list is apropriate for datasize?
-		int po2=8,i=0;
-		while(1) {
-			if (po2>=dataSize) {break;}
-			i++;
-			po2 = po2*2;
+static void readTunables() {
+	// Called once, from initHeap. Everything the strategies differ in is chosen here, so malloc doesn't have to
+	int strategy = readSizeTunable("MALLOCLIB_STRATEGY",STRATEGY), quickLists = readSizeTunable("MALLOCLIB_QUICKLISTS",NRQUICKLISTS);
+	char *env = getenv("MALLOCLIB_SIZE_CLASSES");
+	size_t lastClassSize=0;
+	int i;
+
+	if (strategy < 1 || strategy > 4) {
+		writeString(STDERR_FILENO,"MallocLib: MALLOCLIB_STRATEGY must be 1-4, using the default\n");
+		strategy = STRATEGY;
+	}
+	if (strategy==2) {findFit=bestFit;}
+	else if (strategy==3) {findFit=worstFit;}
+	else {findFit=firstFit;}
+
+	if (strategy==4) {
+		if (env && *env) {
+			// Explicit class sizes, "16,48,128"
+			nrQuickLists=0;
+			while (*env && nrQuickLists < MALLOCLIB_MAX_QUICKLISTS) {
+				size_t classSize = strtoul(env,&env,10);
+				if (classSize <= lastClassSize) {
+					writeString(STDERR_FILENO,"MallocLib: MALLOCLIB_SIZE_CLASSES must be increasing sizes, using the default\n");
+					nrQuickLists=0;
+					break;
+				}
+				lastClassSize = classSize;
+				// Round up to what the block can hold anyway, classes that end up with the same block size are merged
+				classSize = ALIGN(HEADER_SIZE + classSize) - HEADER_SIZE;
+				if (nrQuickLists==0 || classSize != quickListMaxRequest[nrQuickLists-1]) {quickListMaxRequest[nrQuickLists++] = classSize;}
+				if (*env==',') {env++;}
+			}
 		}
-		// Data will be stored on list i
-		if (i>=NRQUICKLISTS) {return NULL;}
-		reqBlock = (memBlock*) ( (void*)listStart + i*HEADER_SIZE);
-
-		while(1) {
-			if (reqBlock->free) {
-				reqBlock->free=0;
-				return (void *)reqBlock + HEADER_SIZE;
+		if (nrQuickLists==0) {
+			if (quickLists < 1 || quickLists > MALLOCLIB_MAX_QUICKLISTS) {
+				writeString(STDERR_FILENO,"MallocLib: MALLOCLIB_QUICKLISTS is out of range, using the default\n");
+				quickLists = NRQUICKLISTS;
 			}
+			nrQuickLists = quickLists;
+			for (i=0;i<nrQuickLists;i++) {quickListMaxRequest[i] = 8 << i;}
+		}
+	}
 
-			if (reqBlock->next==NULL) {
-				reqBlock->next = extendHeap(po2);
-				return (void *)reqBlock->next + HEADER_SIZE;
-			}
-			reqBlock=reqBlock->next;
+	trimThreshold = readSizeTunable("MALLOCLIB_TRIM_THRESHOLD",TRIM_THRESHOLD);
+	topPad = readSizeTunable("MALLOCLIB_TOP_PAD",TOP_PAD);
+
+	largeThreshold = readSizeTunable("MALLOCLIB_LARGE_THRESHOLD",LARGE_THRESHOLD);
+	hugePages = readSizeTunable("MALLOCLIB_HUGEPAGES",HUGE_PAGES);
+	if (hugePages < 0 || hugePages > 2) {
+		writeString(STDERR_FILENO,"MallocLib: MALLOCLIB_HUGEPAGES must be 0-2, using the default\n");
+		hugePages = HUGE_PAGES;
+	}
+	numaArenas = readSizeTunable("MALLOCLIB_NUMA",NUMA_ARENAS) != 0;
+	arenaCache = readSizeTunable("MALLOCLIB_ARENA_CACHE",ARENA_CACHE);
+}
+
+static void initHeap() {
+	// Called with the heap lock held, at the first allocation. getenv and sigaction don't allocate
+	char *env;
+
+	heapInitialized=1;
+	readTunables();
+	stats.nrQuickLists = nrQuickLists;
+
+	env = getenv("MALLOCLIB_STATS");
+	dumpStatsAtExit = env && *env && *env!='0';
+
+	env = getenv("MALLOCLIB_PROFILE");
+	if (env && atol(env) > 0) {
+		struct sigaction action;
+
+		profileInterval = atol(env);
+		bytesUntilSample = profileInterval;
+
+		memset(&action,0,sizeof action);
+		action.sa_handler = profileSignalHandler;
+		action.sa_flags = SA_RESTART;
+		sigaction(PROFILE_SIGNAL,&action,NULL);
+	}
+
+	env = getenv("MALLOCLIB_TRACE");
+	if (env && *env) {
+		// Only this process is recorded, programs it starts would truncate the file again. unsetenv doesn't allocate
+		traceFd = open(env,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+		tracePid = getpid();
+		if (traceFd<0) {writeString(STDERR_FILENO,"MallocLib: unable to open the MALLOCLIB_TRACE file\n");}
+		unsetenv("MALLOCLIB_TRACE");
+	}
+}
+
+static inline int countAllocation(size_t dataSize) {
+	// Updates the counters for a successful allocation. Returns 1 if profiling is on and it is sampled
+	int sizeClass = (dataSize <= 1) ? 0 : (int) (8*sizeof (long) - __builtin_clzl(dataSize-1));
+
+	stats.nrMallocs++;
+	stats.nrAllocated++;
+	stats.allocCount[sizeClass < MALLOCLIB_NR_SIZE_CLASSES ? sizeClass : MALLOCLIB_NR_SIZE_CLASSES-1]++;
+
+	if (!profileInterval || (bytesUntilSample -= dataSize) > 0) {return 0;}
+	bytesUntilSample += profileInterval;
+	if (bytesUntilSample <= 0) {bytesUntilSample = profileInterval;} // Allocation larger than the interval
+	return 1;
+}
+
+static void captureStack(void *site, void **stack) {
+	/* Fills stack with site, the return address into the program, and the return addresses of its callers. The
+	 * first backtrace loads the unwinder, which allocates, so until it returns the samples only get site
+	 */
+	void *frames[PROFILE_STACK_DEPTH + 8]; // Room for the frames inside MallocLib
+	int nrFrames, first, i, expected=0;
+
+	stack[0] = site;
+	if (__atomic_load_n(&stackWalkReady,__ATOMIC_ACQUIRE)!=2) {
+		if (!__atomic_compare_exchange_n(&stackWalkReady,&expected,1,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {return;}
+		backtrace(frames,1);
+		__atomic_store_n(&stackWalkReady,2,__ATOMIC_RELEASE);
+	}
+	nrFrames = backtrace(frames,sizeof frames / sizeof *frames);
+	for (first=0;first<nrFrames && frames[first]!=site;first++);
+	for (i=1;i<PROFILE_STACK_DEPTH && first+i<nrFrames;i++) {stack[i] = frames[first+i];} // Nothing if site wasn't found
+}
+
+static void recordSample(void *site, size_t dataSize) {
+	/* Adds a sampled allocation to the open addressed table of sites, keyed on its stack. Called after the heap lock
+	 * is released, since walking the stack may allocate. If the table is full the sample is dropped
+	 */
+	void *stack[PROFILE_STACK_DEPTH] = {0};
+	size_t hash=0, i;
+
+	captureStack(site,stack);
+	for (i=0;i<PROFILE_STACK_DEPTH;i++) {hash = (hash ^ ((size_t)stack[i] >> 4)) * 2654435761u;}
+
+	lockHeap();
+	for (i=0;i<PROFILE_TABLE_SIZE;i++) {
+		profileEntry *entry = &profileTable[(hash + i) & (PROFILE_TABLE_SIZE-1)];
+		if (!entry->stack[0] || memcmp(entry->stack,stack,sizeof stack)==0) {
+			memcpy(entry->stack,stack,sizeof stack);
+			entry->samples++;
+			entry->bytes += dataSize;
+			entry->estimatedBytes += (dataSize > (size_t) profileInterval) ? dataSize : (size_t) profileInterval;
+			break;
 		}
 	}
+	unlockHeap();
+}
 
-	// Use first/best/worst fit
-	dataSize = ALIGN(dataSize+HEADER_SIZE);
-	dataSize -= HEADER_SIZE;
+static void *mallocUnlocked(size_t dataSize) {
+	if (dataSize==0 || dataSize > ((size_t) -1) - MIN_BLOCK_SIZE) {return (void*) 0;}
+	memBlock *reqBlock;
+	size_t size;
+	int i=-1;
 
-	if (!listStart) {
-		// First call
-		reqBlock = extendHeap(dataSize);
-		if (!reqBlock) {return NULL;} //mmap fail
+	if (!heapInitialized) {initHeap();}
+	if (largeThreshold && dataSize >= largeThreshold) {return largeMallocUnlocked(ALIGNMENT,dataSize);}
+	if (dataSize > (size_t) INTPTR_MAX) {errno = ENOMEM; return NULL;} // The heap can't grow that much, and the block size would overflow
 
-		listStart = reqBlock;
+	if (nrQuickLists && dataSize <= quickListMaxRequest[nrQuickLists-1]) {
+		// Which list is apropriate for datasize?
+		for (i=0;quickListMaxRequest[i] < dataSize;i++);
 
-		return (void *)reqBlock + HEADER_SIZE;
+		if (quickLists[i]) {
+			reqBlock = quickLists[i];
+			quickLists[i] = reqBlock->next;
+			stats.quickListLength[i]--;
+			stats.bytesInQuickLists -= blockSize(reqBlock);
+			stats.bytesInUse += blockSize(reqBlock);
+			return payloadOf(reqBlock);
+		}
+		size = quickListBlockSize(i);
 	}
+	else {size = requestToBlockSize(dataSize);} // Use first/best/worst fit
 
-	if (STRATEGY==1 || STRATEGY==4) {reqBlock=firstFit(dataSize);}
-	else if (STRATEGY==2) {reqBlock=bestFit(dataSize);}
-	else if (STRATEGY==3) {reqBlock=worstFit(dataSize);}
+	reqBlock = getFreeBlock(size);
+	if (!reqBlock) {return NULL;} // sbrk fail
+
+	void *vPoint = allocateBlock(reqBlock,size);
+	if (i>=0) {reqBlock->sizeAndStatus |= QUICK_BIT;}
+	return vPoint;
+}
 
-	if (!reqBlock) {reqBlock = extendHeap(dataSize);} // No space in list, allocate
-	if (!reqBlock) {return NULL;} // mmap fail
-	if (reqBlock->size > dataSize+HEADER_SIZE) {splitBlock(reqBlock,dataSize);} // Split the block
+static void *alignedMallocUnlocked(size_t alignment, size_t dataSize) {
+	// alignment must be a power of 2
+	if (alignment <= ALIGNMENT) {return mallocUnlocked(dataSize);}
+	if (dataSize==0 || dataSize > ((size_t) -1) - MIN_BLOCK_SIZE - 2*alignment) {return (void*) 0;}
+	if (!heapInitialized) {initHeap();}
+	if (largeThreshold && dataSize >= largeThreshold) {return largeMallocUnlocked(alignment,dataSize);}
+	if (dataSize > (size_t) INTPTR_MAX || alignment > (size_t) INTPTR_MAX/2) {errno = ENOMEM; return NULL;} // See mallocUnlocked
 
-	return (void *)reqBlock + HEADER_SIZE;
+	size_t size = requestToBlockSize(dataSize);
+	// Get a block with room for an aligned payload, and for a free block in front of it if the payload has to move
+	memBlock *reqBlock = getFreeBlock(size + alignment + MIN_BLOCK_SIZE), *alignedBlock;
+	if (!reqBlock) {return NULL;}
+
+	char *payload = payloadOf(reqBlock);
+	if ((size_t)payload % alignment != 0) {
+		// Split off the front of the block, so that the payload of the remaining block is aligned
+		char *alignedPayload = (char *) (((size_t)payload + MIN_BLOCK_SIZE + alignment - 1) & ~(alignment - 1));
+		size_t leadSize = alignedPayload - payload;
+
+		alignedBlock = blockOf(alignedPayload);
+		alignedBlock->sizeAndStatus = (blockSize(reqBlock) - leadSize) | FREE_BIT | PREV_FREE_BIT;
+		reqBlock->sizeAndStatus = leadSize | FREE_BIT | (reqBlock->sizeAndStatus & PREV_FREE_BIT);
+		insertFree(reqBlock);
+		reqBlock = alignedBlock;
+	}
+
+	return allocateBlock(reqBlock,size);
 }
 
-void *realloc(void* vPoint, size_t dataSize) {
-	if (vPoint==0) {return malloc(dataSize);}
-	if (dataSize==0) {return (void*) 0;}
+void free(void * vPoint) {
+	lockHeap();
+	traceFree(vPoint);
+	freeUnlocked(vPoint);
+	unlockHeap();
+	dumpIfRequested();
+}
+
+void *malloc(size_t dataSize) {
+	lockHeap();
+	void *vPoint = mallocUnlocked(dataSize);
+	int sampled = vPoint && countAllocation(dataSize);
+	traceMalloc(vPoint,dataSize);
+	unlockHeap();
+	if (sampled) {recordSample(__builtin_return_address(0),dataSize);}
+	dumpIfRequested();
+	return vPoint;
+}
+
+void *calloc(size_t nmemb, size_t dataSize) {
+	if (dataSize && nmemb > ((size_t) -1) / dataSize) {return NULL;} // Overflow
+	dataSize *= nmemb;
 
-	memBlock *oldBlock = (memBlock *) (vPoint - HEADER_SIZE);
-	void *newBlock = malloc(dataSize);
+	lockHeap();
+	char *cleanFrom = heapHighWater; // Everything above the old high water mark comes fresh (zeroed) from the kernel
+	char *vPoint = mallocUnlocked(dataSize);
+	int large = vPoint && (blockOf(vPoint)->sizeAndStatus & LARGE_BIT), reused = largeReused;
+	int sampled = vPoint && countAllocation(dataSize);
+	traceMalloc(vPoint,dataSize);
+	unlockHeap();
+	if (sampled) {recordSample(__builtin_return_address(0),dataSize);}
+	dumpIfRequested();
 
-	int limit;
-	if (dataSize > oldBlock->size) {
-		limit = oldBlock->size;
+	if (large) {
+		// A fresh mapping is zeroed by the kernel, one from an arena is not
+		if (reused) {memset(vPoint,0,dataSize);}
 	}
-	else {limit = dataSize;}
+	else if (vPoint && vPoint < cleanFrom) {
+		memset(vPoint,0,(vPoint + dataSize <= cleanFrom) ? dataSize : (size_t) (cleanFrom - vPoint));
+	}
+	return vPoint;
+}
 
-	int i;
-	char *newpos = newBlock, *oldpos = vPoint;
-	for (i=0;i<limit;i++) {
-		*newpos=*oldpos;
-		newpos++;
-		oldpos++;
+void *realloc(void* vPoint, size_t dataSize) {
+	if (vPoint==0) {return malloc(dataSize);}
+	if (dataSize==0) {free(vPoint); return (void*) 0;}
+
+	size_t oldSize = blockSize(blockOf(vPoint)) - HEADER_SIZE;
+	if (dataSize <= oldSize) {
+		// Still fits in the block
+		if (traceFd>=0) {lockHeap(); traceRealloc(vPoint,vPoint,dataSize); unlockHeap();}
+		return vPoint;
 	}
 
-	free(vPoint);
+	lockHeap();
+	void *newBlock = mallocUnlocked(dataSize);
+	int sampled = newBlock && countAllocation(dataSize);
+	if (newBlock) {
+		traceRealloc(vPoint,newBlock,dataSize);
+		memcpy(newBlock,vPoint,oldSize);
+		freeUnlocked(vPoint);
+	}
+	unlockHeap();
+	if (sampled) {recordSample(__builtin_return_address(0),dataSize);}
+	dumpIfRequested();
 	return newBlock;
 }
 
+static void *alignedMalloc(size_t alignment, size_t dataSize, void *site) {
+	lockHeap();
+	void *vPoint = alignedMallocUnlocked(alignment,dataSize);
+	int sampled = vPoint && countAllocation(dataSize);
+	traceMalloc(vPoint,dataSize);
+	unlockHeap();
+	if (sampled) {recordSample(site,dataSize);}
+	dumpIfRequested();
+	return vPoint;
+}
+
+void *memalign(size_t alignment, size_t dataSize) {
+	if (alignment & (alignment - 1)) {errno = EINVAL; return NULL;}
+	return alignedMalloc(alignment,dataSize,__builtin_return_address(0));
+}
+
+void *aligned_alloc(size_t alignment, size_t dataSize) {
+	if (alignment & (alignment - 1)) {errno = EINVAL; return NULL;}
+	return alignedMalloc(alignment,dataSize,__builtin_return_address(0));
+}
+
+int posix_memalign(void **memPtr, size_t alignment, size_t dataSize) {
+	if ((alignment & (alignment - 1)) || alignment % sizeof (void *) != 0) {return EINVAL;}
+
+	void *vPoint = alignedMalloc(alignment,dataSize,__builtin_return_address(0));
 
+	if (!vPoint && dataSize) {return ENOMEM;}
+	*memPtr = vPoint;
+	return 0;
+}
 
+void *valloc(size_t dataSize) {
+	return alignedMalloc(sysconf(_SC_PAGESIZE),dataSize,__builtin_return_address(0));
+}
 
+void *pvalloc(size_t dataSize) {
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	return alignedMalloc(pageSize,(dataSize + pageSize - 1) & ~(pageSize - 1),__builtin_return_address(0));
+}
+
+size_t malloc_usable_size(void *vPoint) {
+	if (vPoint==0) {return 0;}
+	return blockSize(blockOf(vPoint)) - HEADER_SIZE;
+}
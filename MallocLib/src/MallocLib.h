@@ -0,0 +1,47 @@
+#ifndef MALLOCLIB_H
+#define MALLOCLIB_H
+
+#include <stddef.h>
+
+/* Statistics and heap profiling interface of MallocLib. The counters are kept up to date by every allocation
+ * and free, while the free list scan needed for the fragmentation figures is only done when the statistics are
+ * requested.
+ *
+ * Environment variables read at the first allocation:
+ * MALLOCLIB_STATS=1        print the statistics to stderr when the program exits
+ * MALLOCLIB_PROFILE=bytes  sample on average one allocation every "bytes" allocated bytes and record its call
+ *                          stack. The profile is printed to stderr when the program exits, and by the first malloc
+ *                          or free after the program gets SIGUSR2
+ * MALLOCLIB_TRACE=file     record every malloc, realloc and free of the program in file, in the trace format that
+ *                          Benchmark.c replays. Only the process itself is recorded, not the programs it starts
+ */
+
+#define MALLOCLIB_NR_SIZE_CLASSES 32 // Size class i counts requests of 2^(i-1)+1 to 2^i bytes
+#define MALLOCLIB_MAX_QUICKLISTS 16
+
+typedef struct mallocLibStats {
+	size_t bytesMapped; // Bytes obtained from the kernel
+	size_t bytesInUse; // Bytes in allocated blocks, headers included
+	size_t bytesFree; // Bytes in the free list
+	size_t bytesInQuickLists; // Bytes in freed blocks kept on the quick lists
+	size_t largestFreeBlock;
+	double fragmentation; // 1 - largestFreeBlock/bytesFree, 0 if all free memory is in one block
+
+	size_t nrMallocs, nrFrees;
+	size_t nrAllocated; // Blocks currently allocated
+	size_t allocCount[MALLOCLIB_NR_SIZE_CLASSES]; // Allocations per request size class
+
+	size_t largeBlocks; // Allocated blocks with a mapping of their own
+	size_t hugePageMappings; // Large mappings with explicit huge pages, allocated or in an arena
+	size_t bytesInArenas; // Freed large mappings kept for reuse
+
+	size_t freeListLength;
+	int nrQuickLists;
+	size_t quickListLength[MALLOCLIB_MAX_QUICKLISTS];
+} mallocLibStats;
+
+void mallocLibGetStats(mallocLibStats *stats);
+void mallocLibDumpStats(int fd);
+void mallocLibDumpProfile(int fd);
+
+#endif